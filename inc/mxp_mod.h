@@ -12,11 +12,49 @@
 /* current version of Linux MXP doesn't use dynamic MXP configuration */
 #define MAX_TMROBJS      1023
 #define MXP_TASK_MAX     128
-#define MAX_MASSAGES     16384
 #define MAX_QUEUES       1024
+#define MAX_SQUEUES      256
+#define MAX_FANOUTS      32
+#define MAX_SEMAPHORES   64
+#define MAX_MUTEXES      64
+#define MAX_LWTHREADS    1024
 #define MAX_SEGMENTS     8
 #define MAX_TIMERS       650
 
+/* max depth a queue, sorted queue or fan-out object may be created with;
+   keeps the size of the rings allocated at create time in range on 32-bit */
+#define MXP_QUEUE_MAX_DEPTH  65536
+
+/* number of priority levels a queue may be created with */
+#define MXP_QUEUE_MAX_LEVELS 8
+
+/* max payload size of a copy-mode queue message */
+#define MXP_QUEUE_MAX_PAYLOAD 512
+
+/* max number of message pointers returned by one MXP_QUEUE_PEEK */
+#define MXP_QUEUE_PEEK_MAX   32
+
+/* max number of queues one MXP_QUEUE_WAIT_ANY waits on */
+#define MXP_QUEUE_WAITANY_MAX 8
+
+/* max number of queues subscribed to one fan-out object */
+#define MXP_FANOUT_MAX_SUBS   16
+
+/* longest spin before sleep a task may ask for with MXP_TASK_SPIN, in us */
+#define MXP_TASK_SPIN_MAX     1000
+#define MXP_TASK_SPIN_KEEP    0xFFFFFFFF  /* MXP_TASK_SPIN: only read the counters */
+
+/* MXP_QUEUE_WAIT_ANY flags (MXP_CMD_T.cp.qany.flags) */
+#define MXP_QWAIT_ORDERED 0x0001  /* qids[0] has the highest priority */
+
+/* queue post flags (MXP_CMD_T.cp.q.flags) */
+#define MXP_QPOST_JAM    0x0001   /* insert at the head of the level (XqJam) */
+#define MXP_QPOST_SWITCH 0x0002   /* yield to the woken owner task (MX_SWITCH) */
+
+/* queue create flags (MXP_CMD_T.cp.q.flags) */
+#define MXP_QUEUE_CONFLATE 0x0100 /* keep only the latest message per key */
+#define MXP_QUEUE_DEADLINE 0x0200 /* messages may be posted with an expiry time */
+
 #define MAX_NAME_LEN   16
 #define MIN_TASK_STACKSIZE 0x4000
 
@@ -37,6 +75,86 @@ typedef struct TMROBJ_tag{
   int            wait4event;  
 } TMROBJ_T;
 
+/* queue statistics returned by MXP_QUEUE_STATS; delays are in units of 1024 ns,
+   delay_hist[N] counts delays in [2^(N-1), 2^N) units, the last one is open ended */
+#define MXP_QSTAT_HIST_LEN 16
+
+typedef struct {
+  unsigned long   posts;
+  unsigned long   waits;
+  unsigned long   drops;      /* posts failed with ERR_QFULL */
+  unsigned long   conflated;  /* posts that replaced a pending message */
+  unsigned long   expired;    /* stale messages dropped by wait */
+  unsigned long   reclaim_lost; /* expired messages pushed out of a full reclaim ring */
+  unsigned long   hwm;        /* max number of pending messages */
+  unsigned long   throttles;  /* times the high watermark was reached */
+  int             throttled;  /* the producer is throttled now */
+  unsigned long   delay_max;
+  unsigned long long delay_sum;
+  unsigned long   delay_hist[MXP_QSTAT_HIST_LEN];
+  unsigned long   since;      /* system tick of the last reset */
+  unsigned long   now;        /* system tick when the statistics were taken */
+  int             msgcnt;
+  int             depth;
+} MXP_QSTATS_T;
+
+/* max number of lightweight threads returned by one MXP_LWT_RUN */
+#define MXP_LWT_RUN_MAX      32
+
+/* why a lightweight thread is runnable */
+#define MXP_LWT_EVENT        0x0001  /* posted events satisfy its event mask */
+#define MXP_LWT_WOKE         0x0002  /* its sleep is over */
+
+/* one runnable lightweight thread returned by MXP_LWT_RUN */
+typedef struct {
+  int             lwid;
+  int             why;      /* MXP_LWT_xxx */
+  unsigned long   events;   /* the events that matched, taken from the thread */
+} MXP_LWT_RUN_T;
+
+/* MXP system call parameter type of the original ioctl codes (MXP_QUEUE_POST up
+   to MXP_TASK_SLEEP). Its size is encoded in those codes, so it is frozen;
+   MXP_CMD_T below starts with the same fields in the same places. */
+typedef struct {
+  int result;
+  union {
+    struct {
+      char   name[MAX_NAME_LEN];
+      int    prio;
+      int    pid;
+      int    tid;
+    } task;
+    struct {
+      int    tid;
+      int    timeout;
+    } task_cmd;
+    struct {
+      int          tid;
+      unsigned long events;
+      int          condition;
+      unsigned int timeout;
+    } ev;
+    struct {
+      int           qid;
+      unsigned int  timeout;
+      void          *msg_ptr;
+      int           depth;
+      unsigned long events;
+      int           tid;
+      char          name[MAX_NAME_LEN];
+    } q;
+    struct {
+      int           tmr_id;
+      unsigned long ev_fl;
+      int           qid;
+      void         *msg;
+      int           tsk_id;
+      unsigned long timeout;
+      unsigned long reload;
+    } tmr;
+  } cp;
+} MXP_CMD_V1_T;
+
 /* MXP system call parameter type */
 typedef struct {
   int result;
@@ -65,7 +183,136 @@ typedef struct {
       unsigned long events;
       int           tid;
       char          name[MAX_NAME_LEN];
+      /* the fields below are only passed by the MXP_QUEUE_xxx_EX codes,
+         the original codes run with all of them 0 */
+      int           levels;  /* create: number of priority levels, 0 means 1 */
+      int           prio;    /* post: level to post to; wait: level received */
+      int           flags;   /* create: MXP_QUEUE_xxx; post: MXP_QPOST_xxx */
+      int           key;     /* post: message key (conflating queues only) */
+      unsigned long expire;  /* post: ticks until the message becomes stale,
+                                0 - never (deadline queues only) */
+      int           msgsize; /* create: max payload size, 0 - pointer queue;
+                                post: payload size; wait: in buffer size,
+                                out payload size (copy-mode queues only) */
+      int           hiwat;   /* create: msgcnt that posts ev_hiwat to ptid, 0 - off */
+      int           lowat;   /* create: msgcnt that posts ev_lowat to ptid after hiwat */
+      int           ptid;    /* create: producer task to throttle */
+      unsigned long ev_hiwat;
+      unsigned long ev_lowat;
     } q;
+    struct {             /* MXP_QUEUE_LVL_INQUIRY */
+      int           qid;
+      int           levels;
+      int           msgcnt[MXP_QUEUE_MAX_LEVELS];
+    } qlvl;
+    struct {             /* MXP_QUEUE_PEEK */
+      int           qid;
+      void          *msg_ptr; /* first message */
+      int           count;    /* in: size of msgs[]; out: pointers copied */
+      void          **msgs;   /* optional user buffer, may be NULL */
+    } qpeek;
+    struct {             /* MXP_QUEUE_WAIT_ANY */
+      int           qids[MXP_QUEUE_WAITANY_MAX];
+      int           nqids;
+      int           flags;   /* MXP_QWAIT_xxx */
+      unsigned int  timeout;
+      int           qid;     /* in: queue served last time; out: queue served */
+      void          *msg_ptr;
+      int           prio;
+      int           msgsize;
+    } qany;
+    struct {             /* MXP_QUEUE_STATS */
+      int           qid;
+      int           reset;   /* nonzero: clear the statistics after reading */
+      MXP_QSTATS_T  *stats;  /* user buffer, may be NULL */
+    } qstats;
+    struct {             /* MXP_QUEUE_RECLAIM */
+      int           qid;
+      int           count;   /* in: size of msgs[]; out: pointers copied */
+      void          **msgs;  /* user buffer */
+    } qrcl;
+    struct {             /* MXP_FANOUT_xxx */
+      int           fid;
+      int           qid;     /* subscriber queue */
+      int           limit;   /* subscribe: max messages pending per subscriber,
+                                0 - the queue depth only */
+      int           depth;   /* create: max messages in flight */
+      int           count;   /* post: subscribers that got the message;
+                                reclaim: in - size of msgs[], out - copied;
+                                inquiry: messages pending at the subscriber */
+      int           slot;    /* post: out - inflight slot of the message, -1 if
+                                not kept; release: in - the slot it got */
+      unsigned long drops;   /* inquiry: posts dropped for the subscriber */
+      void          *msg_ptr;
+      void          **msgs;  /* reclaim: user buffer */
+      char          name[MAX_NAME_LEN];
+    } fan;
+    struct {             /* MXP_SEM_xxx */
+      int           sid;
+      int           count;   /* create: initial tokens; post: tokens to add,
+                                0 - only wake the waiters; inquiry: initial tokens */
+      int           avail;   /* inquiry: tokens available */
+      unsigned long timeout; /* wait: ticks, MX_NO_BLOCK or MX_INDEFINITE */
+      char          name[MAX_NAME_LEN];
+    } sem;
+    struct {             /* MXP_MUTEX_xxx */
+      int           mid;
+      int           tid;     /* lock, unlock: the calling task */
+      unsigned long timeout; /* lock: ticks, MX_NO_BLOCK or MX_INDEFINITE */
+      char          name[MAX_NAME_LEN];
+    } mtx;
+    struct {             /* MXP_LWT_xxx */
+      int           lwid;
+      int           tid;     /* create: the task that runs the thread;
+                                run: the calling task */
+      unsigned long events;  /* setmask: event mask; post: events to post;
+                                inquiry: events posted and not taken yet */
+      int           condition; /* setmask: MX_OR_COND or MX_AND_COND */
+      unsigned long timeout; /* sleep: ticks; run: ticks, MX_NO_BLOCK or MX_INDEFINITE */
+      int           sleeping;/* inquiry: the thread sleeps */
+      int           count;   /* run: in - size of run[], out - entries copied */
+      MXP_LWT_RUN_T *run;    /* run: user buffer */
+    } lwt;
+    struct {             /* MXP_RING_xxx */
+      int           tid;
+      int           submit;  /* enter: in - max entries to take from the
+                                submission ring, out - entries taken */
+      int           complete;/* enter: in - completions to wait for,
+                                out - completions posted */
+      unsigned long timeout; /* enter: ticks to wait for them, MX_NO_BLOCK
+                                or MX_INDEFINITE */
+      int           pending; /* enter: out - queue waits not completed yet */
+    } ring;
+    struct {             /* MXP_TASK_SPIN */
+      int           tid;
+      unsigned int  limit;   /* in: longest spin in us, 0 - never spin,
+                                MXP_TASK_SPIN_KEEP - unchanged; out: the limit */
+      unsigned int  window;  /* out: spin window the next wait starts with, us */
+      unsigned long hits;    /* out: waits satisfied while spinning */
+      unsigned long misses;  /* out: waits that spun and went to sleep anyway */
+    } spin;
+    struct {             /* MXP_TASK_SETPRIO, MXP_TASK_GETPRIO */
+      int           tid;
+      int           prio;    /* MXP priority */
+      int           policy;  /* out: SCHED_xxx the task runs with */
+      int           rt_prio; /* out: its real-time priority, 0 if not SCHED_FIFO */
+    } prio;
+    struct {             /* MXP_TASK_AFFINITY */
+      int           tid;
+      unsigned long mask;    /* in: CPUs the task may run on, bit N - CPU N,
+                                0 - unchanged; out: the CPUs it may run on */
+      int           cpu;     /* out: CPU the task ran on last */
+    } aff;
+    struct {             /* MXP_SQUEUE_xxx */
+      int           sqid;
+      unsigned int  timeout;
+      void          *msg_ptr;
+      int           key;     /* smaller key is delivered first */
+      int           depth;
+      unsigned long events;
+      int           tid;
+      char          name[MAX_NAME_LEN];
+    } sq;
     struct {
       int           tmr_id;
       unsigned long ev_fl;
@@ -89,34 +336,274 @@ typedef struct {
   char            name[MAX_NAME_LEN];
 } MXP_MEM_CMD_T;
 
+/* submission and completion rings of MXP commands, one page per task mapped by
+   mmap at page offset MXP_MMAP_RING_PGOFF + task id after MXP_RING_SETUP.
+   User space fills sq[sq_tail % MXP_RING_SQ_ENTRIES] and advances sq_tail, the
+   kernel takes the entries in order on MXP_RING_ENTER and advances sq_head.
+   The kernel fills cq[cq_tail % MXP_RING_CQ_ENTRIES] and advances cq_tail,
+   user space takes the completions and advances cq_head. The indexes only
+   grow; an entry is written before its index is advanced. */
+#define MXP_MMAP_RING_PGOFF  32
+#define MXP_RING_SQ_ENTRIES  64   /* power of 2 */
+#define MXP_RING_CQ_ENTRIES  64   /* power of 2 */
+#define MXP_RING_PENDING     16   /* queue waits in progress per task */
+
+/* submission ring commands */
+#define MXP_SQE_NOP          0
+#define MXP_SQE_QUEUE_POST   1   /* id - qid, msg_ptr, arg - payload size,
+                                    prio, flags - MXP_QPOST_xxx */
+#define MXP_SQE_QUEUE_WAIT   2   /* id - qid, msg_ptr, arg - buffer size,
+                                    timeout - ticks, MX_NO_BLOCK or MX_INDEFINITE */
+#define MXP_SQE_EVENT_POST   3   /* id - tid, arg - events */
+#define MXP_SQE_TMR_START    4   /* id - tmr_id, timeout, arg - reload period */
+#define MXP_SQE_TMR_ABORT    5   /* id - tmr_id */
+
+typedef struct {
+  unsigned short  op;        /* MXP_SQE_xxx */
+  unsigned short  flags;
+  int             id;
+  unsigned long   user_data; /* returned in the completion */
+  void            *msg_ptr;
+  unsigned long   arg;
+  unsigned long   timeout;
+  int             prio;
+} MXP_SQE_T;
+
+typedef struct {
+  unsigned long   user_data;
+  int             result;    /* MX_Result of the command */
+  int             prio;      /* queue wait: level the message came from */
+  void            *msg_ptr;  /* queue wait: the message */
+  unsigned long   arg;       /* queue wait: payload size */
+} MXP_CQE_T;
+
+typedef struct {
+  volatile unsigned int sq_head;
+  volatile unsigned int sq_tail;
+  volatile unsigned int cq_head;
+  volatile unsigned int cq_tail;
+  unsigned int    sq_entries;
+  unsigned int    cq_entries;
+  MXP_SQE_T       sq[MXP_RING_SQ_ENTRIES];
+  MXP_CQE_T       cq[MXP_RING_CQ_ENTRIES];
+} MXP_RING_T;
+
 #ifdef __KERNEL__
 #include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
 
-/* kernel only task control block fields */
+/* kernel only task control block fields, one cache line aligned record per task
+   (MXP_TCB_T below is the page mapped to user space and keeps its layout) */
 typedef struct {
+  spinlock_t         lock;  /* guards the event fields of the task */
+  struct task_struct *task; /* thread that allocated the task, referenced */
   wait_queue_head_t  gate_lock;
   TMROBJ_T           tmrobj;
-} MXP_SUBTCB_T;
+  /* adaptive spin before sleep, only the waiting task itself updates them */
+  unsigned int       spin_max;   /* us, 0 - off */
+  unsigned int       spin_win;   /* us */
+  unsigned int       spin_gap;   /* average wait, us */
+  unsigned long      spin_hits;
+  unsigned long      spin_misses;
+  /* runnable lightweight threads of the task in FIFO order, guarded by lock */
+  short              lwt_head;   /* 0 - none */
+  short              lwt_tail;
+  int                lwt_ready;
+} ____cacheline_aligned_in_smp MXP_SUBTCB_T;
 
 /* queue types */
-typedef struct msg_container_t {
-  struct msg_container_t *p;
-  struct msg_container_t *n;
-  void            *msg;
-} MSG_CONTAINER_T;
+/* ring of message pointers (reclaim rings) */
+typedef struct msg_ring_t {
+  void            **msg;   /* depth entries */
+  int             head;
+  int             cnt;
+} MSG_RING_T;
+
+/* one priority level of a queue: a FIFO list of entries of the queue entry pool */
+typedef struct msg_level_t {
+  int             head;    /* entry index, -1 - empty */
+  int             tail;
+  int             cnt;
+} MSG_LEVEL_T;
 
+/* payload store of a copy-mode queue, one slot per queue entry */
+typedef struct mxp_qpayload_t {
+  int             refs;     /* queue + copies in progress */
+  int             msgsize;
+  int             nfree;
+  int             *freeslot;/* stack of free slot indexes */
+  int             *len;     /* payload size per slot */
+  unsigned char   *data;
+} MXP_QPAYLOAD_T;
+
+/* Queue control blocks are split in two arrays. The hot part holds everything
+   post and wait touch and is cache line aligned, so posts to neighbouring
+   queues from different CPUs do not share cache lines; the fields used by
+   post/wait on every call come first. The cold part holds the name and the
+   fields used at create/delete or in the slow paths only. */
 typedef struct msg_queue_t {
-  MSG_CONTAINER_T *head;
-  MSG_CONTAINER_T *tail;
+  spinlock_t      lock;
+  int             state; /* 0 - free; 1 - busy */
   int             msgcnt;
   int             depth;
+  unsigned long   lvlmask; /* bit N is set while level N is not empty */
+  int             levels;
+  int             flags;    /* MXP_QUEUE_xxx */
+  int             wait4msg;
+  int             waitany; /* MXP_QUEUE_WAIT_ANY callers sleeping on queue_lock */
+  short           ringwait;      /* first submission ring wait linked, 0 - none */
+  short           ringwait_tail;
+  int             taskId;
+  unsigned long   events;
+  MXP_QPAYLOAD_T  *payload; /* NULL unless copy-mode queue */
+  int             hiwat;    /* 0 - no producer backpressure */
+  int             lowat;
+  int             throttled;
+  /* entry pool of depth entries shared by all levels */
+  void            **msg;
+  unsigned long   *stamp;   /* post time of every entry */
+  int             *key;     /* message keys, NULL unless conflating queue */
+  unsigned long   *deadline;/* expiry ticks, NULL unless deadline queue */
+  int             *next;    /* level list or free list link, -1 - last */
+  int             freeent;  /* first free entry, -1 - none */
+  MSG_LEVEL_T     lvl[MXP_QUEUE_MAX_LEVELS];
+  wait_queue_head_t  queue_lock;
+  MXP_QSTATS_T    stats;
+} ____cacheline_aligned_in_smp MSG_QUEUE_T;
+
+typedef struct msg_queue_cold_t {
+  char            name[16];
+  void            *store;   /* the entry pool arrays, vmalloc'ed */
+  MSG_RING_T      reclaim;  /* expired messages of a deadline queue */
+  int             ptid;
+  unsigned long   ev_hiwat;
+  unsigned long   ev_lowat;
+} MSG_QUEUE_COLD_T;
+
+/* sorted queue types */
+typedef struct sq_entry_t {
+  int             key;
+  unsigned int    seq;   /* keeps FIFO order among equal keys */
+  void            *msg;
+} SQ_ENTRY_T;
+
+typedef struct msg_squeue_t {
+  spinlock_t      lock;
+  SQ_ENTRY_T      *heap; /* depth + 1 entries, heap[1] is the first message */
+  int             msgcnt;
+  int             depth;
+  unsigned int    seq;
   int             wait4msg;
   char            name[16];
   int             taskId;
   unsigned long   events;
   wait_queue_head_t  queue_lock;
   int             state; /* 0 - free; 1 - busy */
-} MSG_QUEUE_T;
+} MSG_SQUEUE_T;
+
+/* fan-out types */
+typedef struct mxp_fan_sub_t {
+  int             qid;     /* 0 - free */
+  int             limit;
+  int             pending; /* posted and not released yet */
+  unsigned long   posts;
+  unsigned long   drops;
+} MXP_FAN_SUB_T;
+
+typedef struct mxp_fan_msg_t {
+  void            *msg;
+  unsigned long   subs;    /* bit N is set while subscriber N holds the message */
+} MXP_FAN_MSG_T;
+
+typedef struct mxp_fanout_t {
+  spinlock_t      lock;
+  MXP_FAN_SUB_T   sub[MXP_FANOUT_MAX_SUBS];
+  MXP_FAN_MSG_T   *inflight; /* depth entries */
+  int             *freeslot; /* stack of free inflight entries */
+  int             nfree;
+  MSG_RING_T      reclaim;   /* messages released by all subscribers */
+  int             depth;
+  unsigned long   posts;
+  unsigned long   drops;     /* posts refused since depth was in use */
+  char            name[16];
+  int             state;     /* 0 - free; 1 - busy */
+} MXP_FANOUT_T;
+
+/* semaphore types */
+typedef struct mxp_sem_t {
+  int             state;     /* 0 - free; 1 - busy */
+  unsigned int    gen;       /* bumped by delete, wakes the waiters for good */
+  int             tokens;    /* initial count */
+  char            name[16];
+  wait_queue_head_t  wait;
+} MXP_SEM_T;
+
+/* mutex types */
+typedef struct mxp_mutex_t {
+  spinlock_t      lock;      /* guards the fields below, not the owner word */
+  int             state;     /* 0 - free; 1 - busy */
+  unsigned int    gen;       /* bumped by delete */
+  int             waiters;   /* tasks in MXP_MUTEX_LOCK */
+  int             boost_tid; /* owner running at boost_prio, 0 - none */
+  int             boost_prio;
+  unsigned long   contended; /* locks that had to sleep */
+  char            name[16];
+  wait_queue_head_t  wait;
+} MXP_MUTEX_T;
+
+/* lightweight thread types, the fields are guarded by the lock of the task
+   that runs the thread */
+typedef struct mxp_lwt_t {
+  int             state;     /* 0 - free; 1 - busy */
+  int             tid;       /* the task that runs the thread */
+  unsigned long   events_posted;
+  unsigned long   events_mask;
+  int             events_condition;
+  int             sleeping;
+  int             woke;      /* the sleep is over, not reported yet */
+  int             queued;    /* on the ready list of the task */
+  short           next;      /* ready list link */
+  unsigned long   runs;
+  TMROBJ_T        tmrobj;
+} MXP_LWT_T;
+
+/* queue wait of a submission ring that could not complete at once */
+typedef struct {
+  unsigned long   user_data;
+  int             qid;       /* 0 - free slot */
+  void            *msg_ptr;
+  int             msgsize;
+  unsigned long   deadline;  /* system tick the wait times out at */
+  int             forever;   /* MX_INDEFINITE, deadline is not used */
+  int             async;     /* linked on the queue, completed by its post */
+  short           next;      /* next ring wait linked on the queue, 0 - none */
+  unsigned long   seq;       /* submission order */
+} MXP_RING_WAIT_T;
+
+/* kernel side of the rings of one task */
+typedef struct mxp_ringctl_t {
+  struct mutex    lock;      /* one MXP_RING_ENTER at a time */
+  spinlock_t      cq_lock;   /* completion ring tail, pending slots, counters */
+  MXP_RING_T      *ring;     /* the shared page, NULL - no rings */
+  wait_queue_head_t  wait;   /* MXP_RING_ENTER waiting for a completion */
+  int             npending;
+  MXP_RING_WAIT_T pending[MXP_RING_PENDING];
+  unsigned long   seq;
+  unsigned long   submitted;
+  unsigned long   completed;
+} MXP_RINGCTL_T;
+
+/* MXP API for other kernel drivers. All of them return MX_Result codes (the
+   name lookups return -1 if not found) and may be called from softirq context. */
+extern int tcb_by_name(char *name);
+extern int mxp_ev_post_by_tid(int tid, unsigned long event);
+extern int mxp_q_id_by_name(char *name);
+extern int mxp_q_post_by_qid(int qid, void *msg, int msgsize, int prio);
+extern int mxp_tmr_arm(int *handle, unsigned long timeout, int qid, void *msg,
+                       int tid, unsigned long events);
+extern int mxp_tmr_cancel(int handle);
+extern int mxp_lwt_post_by_id(int lwid, unsigned long events);
 
 #endif
 
@@ -136,6 +623,24 @@ typedef struct {
 
 } MXP_TCB_T;
 
+/* semaphore counters and mutex owner words, the page is mapped by mmap at page
+   offset MXP_MMAP_SEM_PGOFF; sem[N] belongs to semaphore N, mutex[N] to mutex N.
+   They are only changed with atomic operations. */
+typedef struct {
+  volatile int    count;    /* tokens available */
+  volatile int    waiters;  /* tasks sleeping in MXP_SEM_WAIT */
+} MXP_SEM_SHM_T;
+
+#define MXP_MUTEX_WAITERS  0x40000000  /* owner word: unlock must enter the kernel */
+#define MXP_MUTEX_OWNER(w) ((w) & ~MXP_MUTEX_WAITERS) /* task id, 0 - unlocked */
+
+typedef struct {
+  MXP_SEM_SHM_T   sem[MAX_SEMAPHORES];
+  volatile int    mutex[MAX_MUTEXES];
+} MXP_SHM_T;
+
+#define MXP_MMAP_SEM_PGOFF  16   /* page offset 0 maps the task control blocks */
+
 #define MXP_PROC_DIR_NAME "timxp"
 
 /* MXP core ioctl definitions */
@@ -143,28 +648,172 @@ typedef struct {
 #define MXP_CORE_DEVICE_NAME "timxpcore"
 #define MXPCORE_IOCTL_MAGIC 'M'
 
-#define MXP_QUEUE_POST     _IOWR(MXPCORE_IOCTL_MAGIC, 0, MXP_CMD_T) 
-#define MXP_QUEUE_WAIT     _IOWR(MXPCORE_IOCTL_MAGIC, 1, MXP_CMD_T)  
-#define MXP_EVENT_POST     _IOWR(MXPCORE_IOCTL_MAGIC, 2, MXP_CMD_T)  
-#define MXP_EVENT_WAIT     _IOWR(MXPCORE_IOCTL_MAGIC, 3, MXP_CMD_T)  
-#define MXP_EVENT_CLEAR    _IOWR(MXPCORE_IOCTL_MAGIC, 4, MXP_CMD_T)  
-#define MXP_EVENT_INQUIRY  _IOWR(MXPCORE_IOCTL_MAGIC, 5, MXP_CMD_T)  
-#define MXP_QUEUE_CREATE   _IOWR(MXPCORE_IOCTL_MAGIC, 6, MXP_CMD_T)  
-#define MXP_QUEUE_DELETE   _IOWR(MXPCORE_IOCTL_MAGIC, 7, MXP_CMD_T)  
-#define MXP_QUEUE_IDENTIFY _IOWR(MXPCORE_IOCTL_MAGIC, 8, MXP_CMD_T)  
-#define MXP_QUEUE_INQUIRY  _IOWR(MXPCORE_IOCTL_MAGIC, 9, MXP_CMD_T)  
-#define MXP_QUEUE_DELALL   _IOWR(MXPCORE_IOCTL_MAGIC, 10, MXP_CMD_T) 
-#define MXP_TMR_CREATE     _IOWR(MXPCORE_IOCTL_MAGIC, 11, MXP_CMD_T) 
-#define MXP_TMR_START      _IOWR(MXPCORE_IOCTL_MAGIC, 12, MXP_CMD_T) 
-#define MXP_TMR_ABORT      _IOWR(MXPCORE_IOCTL_MAGIC, 13, MXP_CMD_T) 
-#define MXP_TMR_DELETE     _IOWR(MXPCORE_IOCTL_MAGIC, 14, MXP_CMD_T) 
-#define MXP_TMR_GETTICK    _IOWR(MXPCORE_IOCTL_MAGIC, 15, MXP_CMD_T) 
-#define MXP_TASK_ALLOC     _IOWR(MXPCORE_IOCTL_MAGIC, 16, MXP_CMD_T) 
-#define MXP_TASK_IDENTIFY  _IOWR(MXPCORE_IOCTL_MAGIC, 17, MXP_CMD_T) 
-#define MXP_TASK_FREE      _IOWR(MXPCORE_IOCTL_MAGIC, 18, MXP_CMD_T) 
-#define MXP_TASK_SLEEP     _IOWR(MXPCORE_IOCTL_MAGIC, 19, MXP_CMD_T) 
-
-#define MXPCORE_DEV_IOC_MAXNR 19
+#define MXP_QUEUE_POST     _IOWR(MXPCORE_IOCTL_MAGIC, 0, MXP_CMD_V1_T) 
+#define MXP_QUEUE_WAIT     _IOWR(MXPCORE_IOCTL_MAGIC, 1, MXP_CMD_V1_T)  
+#define MXP_EVENT_POST     _IOWR(MXPCORE_IOCTL_MAGIC, 2, MXP_CMD_V1_T)  
+#define MXP_EVENT_WAIT     _IOWR(MXPCORE_IOCTL_MAGIC, 3, MXP_CMD_V1_T)  
+#define MXP_EVENT_CLEAR    _IOWR(MXPCORE_IOCTL_MAGIC, 4, MXP_CMD_V1_T)  
+#define MXP_EVENT_INQUIRY  _IOWR(MXPCORE_IOCTL_MAGIC, 5, MXP_CMD_V1_T)  
+#define MXP_QUEUE_CREATE   _IOWR(MXPCORE_IOCTL_MAGIC, 6, MXP_CMD_V1_T)  
+#define MXP_QUEUE_DELETE   _IOWR(MXPCORE_IOCTL_MAGIC, 7, MXP_CMD_V1_T)  
+#define MXP_QUEUE_IDENTIFY _IOWR(MXPCORE_IOCTL_MAGIC, 8, MXP_CMD_V1_T)  
+#define MXP_QUEUE_INQUIRY  _IOWR(MXPCORE_IOCTL_MAGIC, 9, MXP_CMD_V1_T)  
+#define MXP_QUEUE_DELALL   _IOWR(MXPCORE_IOCTL_MAGIC, 10, MXP_CMD_V1_T) 
+#define MXP_TMR_CREATE     _IOWR(MXPCORE_IOCTL_MAGIC, 11, MXP_CMD_V1_T) 
+#define MXP_TMR_START      _IOWR(MXPCORE_IOCTL_MAGIC, 12, MXP_CMD_V1_T) 
+#define MXP_TMR_ABORT      _IOWR(MXPCORE_IOCTL_MAGIC, 13, MXP_CMD_V1_T) 
+#define MXP_TMR_DELETE     _IOWR(MXPCORE_IOCTL_MAGIC, 14, MXP_CMD_V1_T) 
+#define MXP_TMR_GETTICK    _IOWR(MXPCORE_IOCTL_MAGIC, 15, MXP_CMD_V1_T) 
+#define MXP_TASK_ALLOC     _IOWR(MXPCORE_IOCTL_MAGIC, 16, MXP_CMD_V1_T) 
+#define MXP_TASK_IDENTIFY  _IOWR(MXPCORE_IOCTL_MAGIC, 17, MXP_CMD_V1_T) 
+#define MXP_TASK_FREE      _IOWR(MXPCORE_IOCTL_MAGIC, 18, MXP_CMD_V1_T) 
+#define MXP_TASK_SLEEP     _IOWR(MXPCORE_IOCTL_MAGIC, 19, MXP_CMD_V1_T) 
+#define MXP_QUEUE_LVL_INQUIRY _IOWR(MXPCORE_IOCTL_MAGIC, 20, MXP_CMD_T)
+#define MXP_SQUEUE_CREATE  _IOWR(MXPCORE_IOCTL_MAGIC, 21, MXP_CMD_T)
+#define MXP_SQUEUE_DELETE  _IOWR(MXPCORE_IOCTL_MAGIC, 22, MXP_CMD_T)
+#define MXP_SQUEUE_IDENTIFY _IOWR(MXPCORE_IOCTL_MAGIC, 23, MXP_CMD_T)
+#define MXP_SQUEUE_POST    _IOWR(MXPCORE_IOCTL_MAGIC, 24, MXP_CMD_T)
+#define MXP_SQUEUE_WAIT    _IOWR(MXPCORE_IOCTL_MAGIC, 25, MXP_CMD_T)
+#define MXP_SQUEUE_PEEK    _IOWR(MXPCORE_IOCTL_MAGIC, 26, MXP_CMD_T)
+#define MXP_SQUEUE_INQUIRY _IOWR(MXPCORE_IOCTL_MAGIC, 27, MXP_CMD_T)
+#define MXP_QUEUE_PEEK     _IOWR(MXPCORE_IOCTL_MAGIC, 28, MXP_CMD_T)
+#define MXP_QUEUE_WAIT_ANY _IOWR(MXPCORE_IOCTL_MAGIC, 29, MXP_CMD_T)
+#define MXP_QUEUE_STATS    _IOWR(MXPCORE_IOCTL_MAGIC, 30, MXP_CMD_T)
+#define MXP_QUEUE_RECLAIM  _IOWR(MXPCORE_IOCTL_MAGIC, 31, MXP_CMD_T)
+#define MXP_FANOUT_CREATE  _IOWR(MXPCORE_IOCTL_MAGIC, 32, MXP_CMD_T)
+#define MXP_FANOUT_DELETE  _IOWR(MXPCORE_IOCTL_MAGIC, 33, MXP_CMD_T)
+#define MXP_FANOUT_IDENTIFY _IOWR(MXPCORE_IOCTL_MAGIC, 34, MXP_CMD_T)
+#define MXP_FANOUT_SUBSCRIBE _IOWR(MXPCORE_IOCTL_MAGIC, 35, MXP_CMD_T)
+#define MXP_FANOUT_UNSUBSCRIBE _IOWR(MXPCORE_IOCTL_MAGIC, 36, MXP_CMD_T)
+#define MXP_FANOUT_POST    _IOWR(MXPCORE_IOCTL_MAGIC, 37, MXP_CMD_T)
+#define MXP_FANOUT_RELEASE _IOWR(MXPCORE_IOCTL_MAGIC, 38, MXP_CMD_T)
+#define MXP_FANOUT_RECLAIM _IOWR(MXPCORE_IOCTL_MAGIC, 39, MXP_CMD_T)
+#define MXP_FANOUT_INQUIRY _IOWR(MXPCORE_IOCTL_MAGIC, 40, MXP_CMD_T)
+#define MXP_TASK_SPIN      _IOWR(MXPCORE_IOCTL_MAGIC, 41, MXP_CMD_T)
+#define MXP_TASK_SETPRIO   _IOWR(MXPCORE_IOCTL_MAGIC, 42, MXP_CMD_T)
+#define MXP_TASK_GETPRIO   _IOWR(MXPCORE_IOCTL_MAGIC, 43, MXP_CMD_T)
+#define MXP_TASK_AFFINITY  _IOWR(MXPCORE_IOCTL_MAGIC, 44, MXP_CMD_T)
+#define MXP_SEM_CREATE     _IOWR(MXPCORE_IOCTL_MAGIC, 45, MXP_CMD_T)
+#define MXP_SEM_DELETE     _IOWR(MXPCORE_IOCTL_MAGIC, 46, MXP_CMD_T)
+#define MXP_SEM_IDENTIFY   _IOWR(MXPCORE_IOCTL_MAGIC, 47, MXP_CMD_T)
+#define MXP_SEM_WAIT       _IOWR(MXPCORE_IOCTL_MAGIC, 48, MXP_CMD_T)
+#define MXP_SEM_POST       _IOWR(MXPCORE_IOCTL_MAGIC, 49, MXP_CMD_T)
+#define MXP_SEM_INQUIRY    _IOWR(MXPCORE_IOCTL_MAGIC, 50, MXP_CMD_T)
+#define MXP_MUTEX_CREATE   _IOWR(MXPCORE_IOCTL_MAGIC, 51, MXP_CMD_T)
+#define MXP_MUTEX_DELETE   _IOWR(MXPCORE_IOCTL_MAGIC, 52, MXP_CMD_T)
+#define MXP_MUTEX_IDENTIFY _IOWR(MXPCORE_IOCTL_MAGIC, 53, MXP_CMD_T)
+#define MXP_MUTEX_LOCK     _IOWR(MXPCORE_IOCTL_MAGIC, 54, MXP_CMD_T)
+#define MXP_MUTEX_UNLOCK   _IOWR(MXPCORE_IOCTL_MAGIC, 55, MXP_CMD_T)
+#define MXP_MUTEX_TRYLOCK  _IOWR(MXPCORE_IOCTL_MAGIC, 56, MXP_CMD_T)
+
+#define MXP_LWT_CREATE     _IOWR(MXPCORE_IOCTL_MAGIC, 57, MXP_CMD_T)
+#define MXP_LWT_DELETE     _IOWR(MXPCORE_IOCTL_MAGIC, 58, MXP_CMD_T)
+#define MXP_LWT_SETMASK    _IOWR(MXPCORE_IOCTL_MAGIC, 59, MXP_CMD_T)
+#define MXP_LWT_SLEEP      _IOWR(MXPCORE_IOCTL_MAGIC, 60, MXP_CMD_T)
+#define MXP_LWT_POST       _IOWR(MXPCORE_IOCTL_MAGIC, 61, MXP_CMD_T)
+#define MXP_LWT_RUN        _IOWR(MXPCORE_IOCTL_MAGIC, 62, MXP_CMD_T)
+#define MXP_LWT_INQUIRY    _IOWR(MXPCORE_IOCTL_MAGIC, 63, MXP_CMD_T)
+
+#define MXP_RING_SETUP     _IOWR(MXPCORE_IOCTL_MAGIC, 64, MXP_CMD_T)
+#define MXP_RING_FREE      _IOWR(MXPCORE_IOCTL_MAGIC, 65, MXP_CMD_T)
+#define MXP_RING_ENTER     _IOWR(MXPCORE_IOCTL_MAGIC, 66, MXP_CMD_T)
+
+/* queue create, post and wait with the MXP_CMD_T fields added after the
+   original ones (priority levels, flags, keys, payloads, watermarks) */
+#define MXP_QUEUE_CREATE_EX _IOWR(MXPCORE_IOCTL_MAGIC, 67, MXP_CMD_T)
+#define MXP_QUEUE_POST_EX  _IOWR(MXPCORE_IOCTL_MAGIC, 68, MXP_CMD_T)
+#define MXP_QUEUE_WAIT_EX  _IOWR(MXPCORE_IOCTL_MAGIC, 69, MXP_CMD_T)
+
+#define MXPCORE_DEV_IOC_MAXNR 69
+
+/* Compact ioctls. Every command has its own parameter struct and its size is
+   encoded in the ioctl code; the input fields come first and only the output
+   fields after them are copied back. The MX_Result of the command is the
+   return value of the ioctl itself, a negative value is an errno. The codes
+   above keep working as they are. */
+#define MXPCORE_DEV_IOC_V2BASE 128
+
+typedef struct {         /* MXP_V2_EVENT_POST */
+  int             tid;
+  unsigned long   events;
+} MXP_EV_POST_V2_T;
+
+typedef struct {         /* MXP_V2_EVENT_WAIT */
+  int             tid;
+  int             condition;
+  unsigned long   mask;
+  unsigned int    timeout;
+  /* out */
+  unsigned long   events;
+} MXP_EV_WAIT_V2_T;
+
+typedef struct {         /* MXP_V2_QUEUE_POST */
+  int             qid;
+  int             prio;
+  int             flags;     /* MXP_QPOST_xxx */
+  int             key;
+  int             msgsize;
+  unsigned long   expire;
+  void            *msg_ptr;
+  /* out */
+  void            *replaced; /* conflating queues: the message replaced, NULL
+                                if none; only written on ERR_NOERR */
+} MXP_Q_POST_V2_T;
+
+typedef struct {         /* MXP_V2_QUEUE_WAIT */
+  int             qid;
+  unsigned int    timeout;
+  void            *buf;      /* copy-mode queues: the payload buffer */
+  int             bufsize;
+  /* out */
+  void            *msg_ptr;
+  int             prio;
+  int             msgsize;
+} MXP_Q_WAIT_V2_T;
+
+typedef struct {         /* MXP_V2_TMR_START */
+  int             tmr_id;
+  unsigned long   timeout;
+  unsigned long   reload;
+} MXP_TMR_START_V2_T;
+
+typedef struct {         /* MXP_V2_TASK_SLEEP */
+  int             tid;
+  int             timeout;
+} MXP_TASK_SLEEP_V2_T;
+
+typedef struct {         /* MXP_V2_SEM_WAIT, MXP_V2_SEM_POST */
+  int             sid;
+  int             count;     /* post: tokens to add, 0 - only wake the waiters */
+  unsigned long   timeout;   /* wait */
+} MXP_SEM_V2_T;
+
+typedef struct {         /* MXP_V2_MUTEX_LOCK, MXP_V2_MUTEX_UNLOCK */
+  int             mid;
+  int             tid;
+  unsigned long   timeout;   /* lock */
+} MXP_MTX_V2_T;
+
+typedef struct {         /* MXP_V2_LWT_POST */
+  int             lwid;
+  unsigned long   events;
+} MXP_LWT_POST_V2_T;
+
+#define MXP_V2_EVENT_POST  _IOW(MXPCORE_IOCTL_MAGIC, 128, MXP_EV_POST_V2_T)
+#define MXP_V2_EVENT_WAIT  _IOWR(MXPCORE_IOCTL_MAGIC, 129, MXP_EV_WAIT_V2_T)
+#define MXP_V2_QUEUE_POST  _IOWR(MXPCORE_IOCTL_MAGIC, 130, MXP_Q_POST_V2_T)
+#define MXP_V2_QUEUE_WAIT  _IOWR(MXPCORE_IOCTL_MAGIC, 131, MXP_Q_WAIT_V2_T)
+#define MXP_V2_TMR_START   _IOW(MXPCORE_IOCTL_MAGIC, 132, MXP_TMR_START_V2_T)
+#define MXP_V2_TMR_ABORT   _IOW(MXPCORE_IOCTL_MAGIC, 133, int)
+#define MXP_V2_TMR_GETTICK _IOR(MXPCORE_IOCTL_MAGIC, 134, unsigned long)
+#define MXP_V2_TASK_SLEEP  _IOW(MXPCORE_IOCTL_MAGIC, 135, MXP_TASK_SLEEP_V2_T)
+#define MXP_V2_SEM_WAIT    _IOW(MXPCORE_IOCTL_MAGIC, 136, MXP_SEM_V2_T)
+#define MXP_V2_SEM_POST    _IOW(MXPCORE_IOCTL_MAGIC, 137, MXP_SEM_V2_T)
+#define MXP_V2_MUTEX_LOCK  _IOW(MXPCORE_IOCTL_MAGIC, 138, MXP_MTX_V2_T)
+#define MXP_V2_MUTEX_UNLOCK _IOW(MXPCORE_IOCTL_MAGIC, 139, MXP_MTX_V2_T)
+#define MXP_V2_LWT_POST    _IOW(MXPCORE_IOCTL_MAGIC, 140, MXP_LWT_POST_V2_T)
+
+#define MXPCORE_DEV_IOC_V2MAXNR 140
 
 /* MXP mem ioctl definitions */
 
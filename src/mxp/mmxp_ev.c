@@ -26,11 +26,8 @@ static int mxp_ev_post(MXP_CMD_T*  msg)
   int          tid  = msg->cp.ev.tid;
   int          wake = 0;
 
-  local_irq_save(irq_st);
-  if ((tid <= 0) || (tid >= MXP_TASK_MAX) || (mxp_tcb[tid].busy == 0)){
-    local_irq_restore(irq_st);
+  if (!tcb_lock(tid, &irq_st))
     return ERR_TIDINV;
-  }
 
   mxp_tcb[tid].events_posted |= msg->cp.ev.events;
   mxp_tcb[tid].event_cnt++;
@@ -46,7 +43,7 @@ static int mxp_ev_post(MXP_CMD_T*  msg)
   if (wake)
     mxp_tcb[tid].wait4event = 0;
 
-  local_irq_restore(irq_st); /* TODO: check to move that after wake_up */
+  TCB_UNLOCK(tid, irq_st);
   if (wake)
     wake_up(&(mxp_subtcb[tid].gate_lock));
 
@@ -62,64 +59,84 @@ static int mxp_ev_wait(MXP_CMD_T*  msg)
   unsigned long irq_st;
   int          tid  = msg->cp.ev.tid;
   unsigned long events;
+  unsigned int spin_t0 = 0;
+  int spin = 0;
   int ret;
 
-  local_irq_save(irq_st);
-  if ((tid <= 0) || (tid >= MXP_TASK_MAX) || (mxp_tcb[tid].busy == 0)){
-    local_irq_restore(irq_st);
+  if (!tcb_lock(tid, &irq_st))
     return ERR_TIDINV;
-  }
 
   events = msg->cp.ev.events;
 
+check:
   /* check whether we have events already */
   if (msg->cp.ev.condition == MX_OR_COND){
     if ((mxp_tcb[tid].events_posted & events) != 0){
+      if (spin)
+        tcb_spinDone(tid, spin_t0, 1);
       msg->cp.ev.events = events & mxp_tcb[tid].events_posted;
       mxp_tcb[tid].events_posted &= ~events;
-      local_irq_restore(irq_st);
+      TCB_UNLOCK(tid, irq_st);
       return ERR_NOERR;
     }
   } else if (msg->cp.ev.condition == MX_AND_COND){
     if ((mxp_tcb[tid].events_posted & events) == events){
+      if (spin)
+        tcb_spinDone(tid, spin_t0, 1);
       msg->cp.ev.events = events; 
       mxp_tcb[tid].events_posted &= ~events;
-      local_irq_restore(irq_st);
+      TCB_UNLOCK(tid, irq_st);
       return ERR_NOERR;
     }
   } else {
-    local_irq_restore(irq_st);
+    TCB_UNLOCK(tid, irq_st);
     printk("mxp_ev_wait called for task %d with illegal condition\n", tid);
     return SYS_ILLEGAL_REQUEST; /* condition illegal */
   }
 
   if (msg->cp.ev.timeout == MX_NO_BLOCK){
-    local_irq_restore(irq_st);
+    TCB_UNLOCK(tid, irq_st);
     return ERR_NOEVT;
   }
 
   if (msg->cp.ev.timeout != MX_INDEFINITE){
-    local_irq_restore(irq_st);
+    TCB_UNLOCK(tid, irq_st);
     printk("mxp_ev_wait called for task %d with illegal timeout\n", tid);
     return SYS_ILLEGAL_REQUEST; /* condition illegal */
   }
 
+  /* spin a while before we go to sleep, once per wait */
+  if (TCB_SPINS(tid) && !spin){
+    spin    = 1;
+    spin_t0 = SPIN_STAMP();
+    TCB_UNLOCK(tid, irq_st);
+    ret = tcb_spin(tid, (msg->cp.ev.condition == MX_OR_COND) ?
+                        ((mxp_tcb[tid].events_posted & events) != 0) :
+                        ((mxp_tcb[tid].events_posted & events) == events));
+    if (!tcb_lock(tid, &irq_st))
+      return ERR_TIDINV;
+    if (ret)
+      goto check;
+  }
+
   mxp_tcb[tid].events_condition = msg->cp.ev.condition;
   mxp_tcb[tid].events_mask      = events;
   mxp_tcb[tid].wait4event       = 1;
 
 
-  local_irq_restore(irq_st);
+  TCB_UNLOCK(tid, irq_st);
   ret = wait_event_interruptible( (mxp_subtcb[tid].gate_lock), mxp_tcb[tid].wait4event == 0);
 /*  interruptible_sleep_on( &(mxp_subtcb[tid].gate_lock)); */
-  local_irq_save(irq_st);
+  TCB_LOCK(tid, irq_st);
+  if (spin)
+    tcb_spinDone(tid, spin_t0, 0);
 
   /* after waking up we have to decide whether it was caused by post event or
      other unexpected signal */
   if ( ret == -ERESTARTSYS ){
     /* it was unexpected signal */
     mxp_tcb[tid].wait4event       = 0;
-    local_irq_restore(irq_st);
+    TCB_UNLOCK(tid, irq_st);
     printk( KERN_INFO "mxp_ev_wait for task %d waken up by unexpected signal\n", tid);
     return SYS_CONFIG_ERR;
   }
@@ -133,7 +150,7 @@ static int mxp_ev_wait(MXP_CMD_T*  msg)
     mxp_tcb[tid].events_posted &= ~mxp_tcb[tid].events_mask;
   }
 
-  local_irq_restore(irq_st);
+  TCB_UNLOCK(tid, irq_st);
   return ERR_NOERR;
 }
 
@@ -145,15 +162,12 @@ static int mxp_ev_clear(MXP_CMD_T*  msg)
   unsigned long irq_st;
   int          tid = msg->cp.ev.tid;
 
-  local_irq_save(irq_st);
-  if ((tid <= 0) || (tid >= MXP_TASK_MAX) || (mxp_tcb[tid].busy == 0)){
-    local_irq_restore(irq_st);
+  if (!tcb_lock(tid, &irq_st))
     return ERR_TIDINV;
-  }
 
   mxp_tcb[tid].events_posted &= ~msg->cp.ev.events;
 
-  local_irq_restore(irq_st);
+  TCB_UNLOCK(tid, irq_st);
   return ERR_NOERR;
 }
 /**********************************************************************
@@ -164,13 +178,10 @@ static int mxp_ev_inquiry(MXP_CMD_T*  msg)
   unsigned long irq_st;
   int          tid = msg->cp.ev.tid;
 
-  local_irq_save(irq_st);
-  if ((tid <= 0) || (tid >= MXP_TASK_MAX) || (mxp_tcb[tid].busy == 0)){
-    local_irq_restore(irq_st);
+  if (!tcb_lock(tid, &irq_st))
     return ERR_TIDINV;
-  }
   msg->cp.ev.events = mxp_tcb[tid].events_posted;
-  local_irq_restore(irq_st);
+  TCB_UNLOCK(tid, irq_st);
   return ERR_NOERR;
 }
 /********************************************************************
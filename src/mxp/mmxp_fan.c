@@ -0,0 +1,536 @@
+/*
+ * File name: mmxp_fan.c
+ *
+ * Description: This is part of mxp module implemented fan-out (multicast) queues.
+ *              It must be included into mmxpcore.c and is moved to separate
+ *              file to be readable only.
+ *
+ * Copyright (C) 2008 Texas Instruments, Incorporated
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2.
+ *
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any kind,
+ * whether express or implied; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+   A fan-out object delivers one posted message to every subscribed queue with a
+   single MXP_FANOUT_POST. The message pointer is put to each subscriber queue
+   and is kept in the inflight table with a bit per subscriber that got it.
+   The post returns the inflight slot of the message; the producer passes it to
+   the consumers along with the message (in the message itself, typically) and
+   a consumer gives the message back with MXP_FANOUT_RELEASE and that slot when
+   it is done. When the last subscriber has released it the pointer moves to
+   the reclaim ring and the producer takes it back with MXP_FANOUT_RECLAIM to
+   free it.
+   Each subscription may limit the number of messages pending at that
+   subscriber; a post over the limit (or to a full queue) is dropped for that
+   subscriber only and counted in its drop counter.
+   Inflight entries and reclaim ring entries together never exceed depth, so
+   neither of them can overflow.
+*/
+static MXP_FANOUT_T        mfanout[MAX_FANOUTS];
+
+/* fan_table_lock guards the state of every fan-out going busy or free,
+   each fan-out has its own lock for everything else */
+static DEFINE_SPINLOCK(fan_table_lock);
+
+/* fan-out name index */
+static MXP_NAME_IDX_T      fan_names;
+static short               fan_names_next[MAX_FANOUTS];
+
+/* fan-out ID allocator */
+static MXP_ID_ALLOC_T      fan_ids;
+static DECLARE_BITMAP(fan_ids_map, MAX_FANOUTS);
+static short               fan_ids_stack[MAX_FANOUTS];
+
+#define FAN_LOCK(fid, fl)    spin_lock_irqsave(&(mfanout[fid].lock), fl)
+#define FAN_UNLOCK(fid, fl)  spin_unlock_irqrestore(&(mfanout[fid].lock), fl)
+
+/* lock fan-out fid, returns 0 (and leaves it unlocked) if there is none */
+static inline int fan_lock(int fid, unsigned long *fl)
+{
+  if ((fid <= 0) || (fid >= MAX_FANOUTS))
+    return 0;
+
+  FAN_LOCK(fid, *fl);
+  if (mfanout[fid].state)
+    return 1;
+
+  FAN_UNLOCK(fid, *fl);
+  return 0;
+}
+
+/*********************************************************************************
+* FUNCTION: fan_Init
+*
+* DESCRIPTION: Initialize fan-out pull
+*********************************************************************************/
+void fan_Init(void)
+{
+  int j;
+
+  memset(mfanout, 0, sizeof(mfanout));
+  for (j = 0; j < MAX_FANOUTS; j++)
+    spin_lock_init(&(mfanout[j].lock));
+  mfanout[0].state = 1; /* we don't use fan-out #0 */
+
+  nidx_Init(&fan_names, fan_names_next, mfanout, sizeof(MXP_FANOUT_T),
+            offsetof(MXP_FANOUT_T, name), MAX_FANOUTS);
+  idalloc_Init(&fan_ids, fan_ids_map, fan_ids_stack, MAX_FANOUTS, 1);
+}
+
+/* subscriber index of queue qid, -1 if it is not subscribed */
+static int fan_subByQid(MXP_FANOUT_T *fan, int qid)
+{
+  int j;
+
+  for (j = 0; j < MXP_FANOUT_MAX_SUBS; j++)
+    if (fan->sub[j].qid == qid)
+      return j;
+
+  return -1;
+}
+
+/* drop the reference of subscriber j to inflight entry i */
+static void fan_unref(MXP_FANOUT_T *fan, int i, int j)
+{
+  fan->inflight[i].subs &= ~(1UL << j);
+  fan->sub[j].pending--;
+  if (fan->inflight[i].subs == 0){
+    fan->reclaim.msg[q_ringPut(&(fan->reclaim), fan->depth)] = fan->inflight[i].msg;
+    fan->freeslot[fan->nfree++] = i;
+  }
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_fan_create
+*
+* DESCRIPTION:
+*********************************************************************************/
+static int mxp_fan_create(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  unsigned char *store;
+  int depth = msg->cp.fan.depth;
+  int fid, i;
+
+  if ((depth <= 0) || (depth > MXP_QUEUE_MAX_DEPTH))
+    return ERR_NOMEM;
+
+  /* inflight table, its free stack and the reclaim ring in one block */
+  store = kmalloc((size_t)depth * (sizeof(MXP_FAN_MSG_T) + sizeof(int) + sizeof(void*)), GFP_KERNEL);
+  if (!store)
+    return ERR_NOMEM;
+
+  spin_lock_irqsave(&fan_table_lock, irq_st);
+
+  /* check whether the named fan-out already exists */
+  if (nidx_Find(&fan_names, msg->cp.fan.name) != -1){
+    spin_unlock_irqrestore(&fan_table_lock, irq_st);
+    kfree(store);
+    return ERR_ASGN;
+  }
+
+  if ((fid = idalloc_Get(&fan_ids)) < 0){
+    spin_unlock_irqrestore(&fan_table_lock, irq_st);
+    kfree(store);
+    return ERR_NOQCB;
+  }
+
+  /* the lock must survive, everything behind it is cleared */
+  spin_lock(&(mfanout[fid].lock));
+  memset(mfanout[fid].sub, 0, sizeof(MXP_FANOUT_T) - offsetof(MXP_FANOUT_T, sub));
+  mfanout[fid].state       = 1;
+  strcpy(mfanout[fid].name, msg->cp.fan.name);
+  nidx_Insert(&fan_names, fid);
+  mfanout[fid].depth       = depth;
+  mfanout[fid].inflight    = (MXP_FAN_MSG_T*)store;
+  mfanout[fid].reclaim.msg = (void**)(store + depth * sizeof(MXP_FAN_MSG_T));
+  mfanout[fid].freeslot    = (int*)(store + depth * (sizeof(MXP_FAN_MSG_T) + sizeof(void*)));
+  for (i = 0; i < depth; i++)
+    mfanout[fid].freeslot[i] = depth - 1 - i;
+  mfanout[fid].nfree       = depth;
+
+  msg->cp.fan.fid = fid;
+
+  spin_unlock(&(mfanout[fid].lock));
+  spin_unlock_irqrestore(&fan_table_lock, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: fan_delete
+*
+* DESCRIPTION: free fan-out fid. Unless force is set it must have no message in
+*              flight or waiting to be reclaimed: the producer would lose the
+*              pointers and a later release would find the table gone.
+*********************************************************************************/
+static int fan_delete(int fid, int force)
+{
+  unsigned long irq_st;
+  void *store;
+
+  if ((fid <= 0) || (fid >= MAX_FANOUTS))
+    return ERR_QIDINV;
+
+  spin_lock_irqsave(&fan_table_lock, irq_st);
+  spin_lock(&(mfanout[fid].lock));
+  if (mfanout[fid].state == 0){
+    spin_unlock(&(mfanout[fid].lock));
+    spin_unlock_irqrestore(&fan_table_lock, irq_st);
+    return ERR_QIDINV;
+  }
+
+  if (!force && ((mfanout[fid].nfree != mfanout[fid].depth) || mfanout[fid].reclaim.cnt)){
+    spin_unlock(&(mfanout[fid].lock));
+    spin_unlock_irqrestore(&fan_table_lock, irq_st);
+    return SYS_ILLEGAL_REQUEST; /* messages not released or reclaimed yet */
+  }
+
+  store = mfanout[fid].inflight;
+  mfanout[fid].inflight = NULL;
+  nidx_Remove(&fan_names, fid);
+  mfanout[fid].state    = 0;
+  idalloc_Put(&fan_ids, fid);
+
+  spin_unlock(&(mfanout[fid].lock));
+  spin_unlock_irqrestore(&fan_table_lock, irq_st);
+  kfree(store);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_fan_delete
+*
+* DESCRIPTION:
+*********************************************************************************/
+static int mxp_fan_delete(MXP_CMD_T*  msg)
+{
+  return fan_delete(msg->cp.fan.fid, 0);
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_fan_delete_all
+*
+* DESCRIPTION: free every fan-out at module unload, in flight or not
+*********************************************************************************/
+static int mxp_fan_delete_all(void)
+{
+  int        j;
+
+  for (j=1; j<MAX_FANOUTS; j++){
+    if (mfanout[j].state > 0)
+      fan_delete(j, 1);
+  }
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_fan_identify
+*
+* DESCRIPTION: find fid by name
+*********************************************************************************/
+static int mxp_fan_identify(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int ret = ERR_NOERR;
+
+  spin_lock_irqsave(&fan_table_lock, irq_st);
+
+  if ((msg->cp.fan.fid = nidx_Find(&fan_names, msg->cp.fan.name)) == -1)
+    ret = ERR_INVNAME;
+
+  spin_unlock_irqrestore(&fan_table_lock, irq_st);
+  return ret;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_fan_subscribe
+*
+* DESCRIPTION: attach queue qid. Conflating and deadline queues drop messages on
+*              their own and can not be subscribed.
+*********************************************************************************/
+static int mxp_fan_subscribe(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int fid = msg->cp.fan.fid;
+  int qid = msg->cp.fan.qid;
+  unsigned long q_st;
+  int flags;
+  int j;
+
+  if (!fan_lock(fid, &irq_st))
+    return ERR_QIDINV;
+
+  if (!q_lock(qid, &q_st)){
+    FAN_UNLOCK(fid, irq_st);
+    return ERR_QIDINV;
+  }
+  flags = mqueue[qid].flags;
+  Q_UNLOCK(qid, q_st);
+
+  if (flags & (MXP_QUEUE_CONFLATE | MXP_QUEUE_DEADLINE)){
+    FAN_UNLOCK(fid, irq_st);
+    return SYS_NO_SUPPORT;
+  }
+
+  if (fan_subByQid(&mfanout[fid], qid) >= 0){
+    FAN_UNLOCK(fid, irq_st);
+    return ERR_ASGN;
+  }
+
+  if ((j = fan_subByQid(&mfanout[fid], 0)) < 0){
+    FAN_UNLOCK(fid, irq_st);
+    return ERR_NOQCB;
+  }
+
+  memset(&(mfanout[fid].sub[j]), 0, sizeof(MXP_FAN_SUB_T));
+  mfanout[fid].sub[j].qid   = qid;
+  mfanout[fid].sub[j].limit = (msg->cp.fan.limit > 0) ? msg->cp.fan.limit : 0;
+
+  FAN_UNLOCK(fid, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_fan_unsubscribe
+*
+* DESCRIPTION: detach queue qid. The subscriber must have released every message
+*              it got first: those still queued or being read would otherwise
+*              go to the reclaim ring and be freed under the consumer.
+*********************************************************************************/
+static int mxp_fan_unsubscribe(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  MXP_FANOUT_T *fan;
+  int fid = msg->cp.fan.fid;
+  int j;
+
+  if (!fan_lock(fid, &irq_st))
+    return ERR_QIDINV;
+  if ((msg->cp.fan.qid <= 0) ||
+      ((j = fan_subByQid(&mfanout[fid], msg->cp.fan.qid)) < 0)){
+    FAN_UNLOCK(fid, irq_st);
+    return ERR_QIDINV;
+  }
+  fan = &mfanout[fid];
+
+  if (fan->sub[j].pending){
+    FAN_UNLOCK(fid, irq_st);
+    return SYS_ILLEGAL_REQUEST; /* messages not released yet */
+  }
+
+  fan->sub[j].qid = 0;
+
+  FAN_UNLOCK(fid, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_fan_post
+*
+* DESCRIPTION: post one message to all subscribers. count returns the number of
+*              subscribers that got it and slot its inflight slot; if count is 0
+*              the message is not kept and stays with the producer.
+*              The subscriber queues are posted with the fan-out lock held (the
+*              fan-out lock comes before the queue locks and the task locks in
+*              the lock order), so a release can't see the message before its
+*              inflight slot is filled in.
+*********************************************************************************/
+static int mxp_fan_post(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  MXP_FANOUT_T *fan;
+  MXP_CMD_T  qmsg;
+  int fid = msg->cp.fan.fid;
+  unsigned long subs = 0;
+  int i, j, cnt = 0;
+
+  if (!fan_lock(fid, &irq_st))
+    return ERR_QIDINV;
+  fan = &mfanout[fid];
+  msg->cp.fan.count = 0;
+  msg->cp.fan.slot  = -1;
+
+  /* the reclaim ring must be able to take the message back */
+  if ((fan->nfree == 0) || (fan->reclaim.cnt + (fan->depth - fan->nfree) >= fan->depth)){
+    fan->drops++;
+    FAN_UNLOCK(fid, irq_st);
+    return ERR_QFULL;
+  }
+  fan->posts++;
+
+  qmsg.cp.q.prio    = 0;
+  qmsg.cp.q.flags   = 0;
+  qmsg.cp.q.key     = 0;
+  qmsg.cp.q.expire  = 0;
+  for (j = 0; j < MXP_FANOUT_MAX_SUBS; j++){
+    if (fan->sub[j].qid == 0)
+      continue;
+
+    if (fan->sub[j].limit && (fan->sub[j].pending >= fan->sub[j].limit)){
+      fan->sub[j].drops++;
+      continue;
+    }
+
+    qmsg.cp.q.qid     = fan->sub[j].qid;
+    qmsg.cp.q.msg_ptr = msg->cp.fan.msg_ptr;
+    if (mxp_q_post_ex(&qmsg, Q_SRC_VALUE) != ERR_NOERR){
+      fan->sub[j].drops++;
+      continue;
+    }
+
+    fan->sub[j].posts++;
+    fan->sub[j].pending++;
+    subs |= 1UL << j;
+    cnt++;
+  }
+
+  if (cnt){
+    i = fan->freeslot[--fan->nfree];
+    fan->inflight[i].msg  = msg->cp.fan.msg_ptr;
+    fan->inflight[i].subs = subs;
+    msg->cp.fan.slot      = i;
+  }
+  msg->cp.fan.count = cnt;
+
+  FAN_UNLOCK(fid, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_fan_release
+*
+* DESCRIPTION: subscriber qid is done with msg_ptr, slot is the one the post of
+*              the message returned
+*********************************************************************************/
+static int mxp_fan_release(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  MXP_FANOUT_T *fan;
+  int fid = msg->cp.fan.fid;
+  int i = msg->cp.fan.slot;
+  int j;
+
+  if (!fan_lock(fid, &irq_st))
+    return ERR_QIDINV;
+  if ((msg->cp.fan.qid <= 0) ||
+      ((j = fan_subByQid(&mfanout[fid], msg->cp.fan.qid)) < 0)){
+    FAN_UNLOCK(fid, irq_st);
+    return ERR_QIDINV;
+  }
+  fan = &mfanout[fid];
+
+  /* the slot must hold this message for this subscriber */
+  if ((i < 0) || (i >= fan->depth) || !(fan->inflight[i].subs & (1UL << j)) ||
+      (fan->inflight[i].msg != msg->cp.fan.msg_ptr)){
+    FAN_UNLOCK(fid, irq_st);
+    return ERR_INVBLK;
+  }
+
+  fan_unref(fan, i, j);
+  FAN_UNLOCK(fid, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_fan_reclaim
+*
+* DESCRIPTION: take up to count messages released by all their subscribers
+*********************************************************************************/
+static int mxp_fan_reclaim(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  void *ptrs[MXP_QUEUE_PEEK_MAX];
+  int fid = msg->cp.fan.fid;
+  int max = msg->cp.fan.count;
+  int cnt = 0;
+
+  if (msg->cp.fan.msgs == NULL)
+    return ERR_NULLPTR;
+  if (max > MXP_QUEUE_PEEK_MAX)
+    max = MXP_QUEUE_PEEK_MAX;
+
+  if (!fan_lock(fid, &irq_st))
+    return ERR_QIDINV;
+
+  while ((cnt < max) && mfanout[fid].reclaim.cnt)
+    ptrs[cnt++] = mfanout[fid].reclaim.msg[q_ringGet(&(mfanout[fid].reclaim), mfanout[fid].depth)];
+
+  FAN_UNLOCK(fid, irq_st);
+
+  msg->cp.fan.count = cnt;
+  if (cnt && copy_to_user((void __user *)msg->cp.fan.msgs, ptrs, cnt * sizeof(void*)))
+    return ERR_NULLPTR;
+
+  return (cnt ? ERR_NOERR : ERR_QEMPTY);
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_fan_inquiry
+*
+* DESCRIPTION: get pending messages and drop counter of subscriber qid
+*********************************************************************************/
+static int mxp_fan_inquiry(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int fid = msg->cp.fan.fid;
+  int j;
+
+  if (!fan_lock(fid, &irq_st))
+    return ERR_QIDINV;
+  if ((msg->cp.fan.qid <= 0) ||
+      ((j = fan_subByQid(&mfanout[fid], msg->cp.fan.qid)) < 0)){
+    FAN_UNLOCK(fid, irq_st);
+    return ERR_QIDINV;
+  }
+
+  msg->cp.fan.count = mfanout[fid].sub[j].pending;
+  msg->cp.fan.drops = mfanout[fid].sub[j].drops;
+
+  FAN_UNLOCK(fid, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_fanout_proc
+*
+* DESCRIPTION: form the output for /proc/timxp/fanout file
+*********************************************************************************/
+static int mxp_fanout_proc(char *buf, char **start, off_t offset,
+                   int count, int *eof, void *data)
+{
+  int len = 0;
+  int i, j;
+
+  len += sprintf(buf + len, "Linux MXP fan-out queues\n");
+  len += sprintf(buf + len, "id  dep inflt reclm    posts    drops name\n");
+  len += sprintf(buf + len, "   qid limit pend    posts    drops\n");
+
+  for (i=1; i<MAX_FANOUTS; i++){
+    if (mfanout[i].state == 0)
+      continue;
+    /* the page is limited, stop before it overflows */
+    if (len > count - 128 * (MXP_FANOUT_MAX_SUBS + 1))
+      break;
+    len += sprintf(buf + len, "%2d %4d %5d %5d %8lu %8lu %s\n", i,
+               mfanout[i].depth, mfanout[i].depth - mfanout[i].nfree,
+               mfanout[i].reclaim.cnt, mfanout[i].posts, mfanout[i].drops,
+               mfanout[i].name);
+    for (j=0; j<MXP_FANOUT_MAX_SUBS; j++){
+      if (mfanout[i].sub[j].qid)
+        len += sprintf(buf + len, "   %3d %5d %4d %8lu %8lu\n",
+                   mfanout[i].sub[j].qid, mfanout[i].sub[j].limit,
+                   mfanout[i].sub[j].pending, mfanout[i].sub[j].posts,
+                   mfanout[i].sub[j].drops);
+    }
+  }
+
+  *eof = 1;
+  return len;
+}
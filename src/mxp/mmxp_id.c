@@ -0,0 +1,90 @@
+/*
+ * File name: mmxp_id.c
+ *
+ * Description: Control block ID allocator of MXP objects (tasks, queues, timers,
+ *              segments). It must be included into mmxpcore.c and mmxpmem.c and
+ *              is moved to separate file to be shared by both modules.
+ *
+ * Copyright (C) 2008 Texas Instruments, Incorporated
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2.
+ *
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any kind,
+ * whether express or implied; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+   Every control block array has a bitmap with a bit set for every ID in use.
+   By default the lowest free ID is taken with find_first_zero_bit, a scan of
+   one word per BITS_PER_LONG IDs instead of one control block per ID.
+   With mxp_id_lifo=1 the free IDs are also kept on a stack and the ID freed
+   last is reused first, its control block is most likely still in the cache.
+   The mode is chosen at module load time, the parameter is read only.
+   The caller holds the table lock of the objects around every allocator call.
+*/
+static int mxp_id_lifo = 0;
+module_param(mxp_id_lifo, int, S_IRUGO);
+MODULE_PARM_DESC(mxp_id_lifo, "Set to 1 to reuse the most recently freed object IDs first");
+
+typedef struct {
+  unsigned long   *map;     /* bit N is set while ID N is in use */
+  short           *stack;   /* free IDs, LIFO mode only */
+  int             top;
+  int             max;
+} MXP_ID_ALLOC_T;
+
+/****************************************************************************************/
+/* set up the allocator of IDs 0..max-1, IDs below first are never given out            */
+static void idalloc_Init(MXP_ID_ALLOC_T *a, unsigned long *map, short *stack,
+                         int max, int first)
+{
+  int j;
+
+  memset(map, 0, ((max + BITS_PER_LONG - 1) / BITS_PER_LONG) * sizeof(unsigned long));
+  for (j = 0; j < first; j++)
+    __set_bit(j, map);
+
+  a->map   = map;
+  a->stack = stack;
+  a->max   = max;
+  a->top   = 0;
+  /* the lowest ID is on the top of the stack at start */
+  for (j = max - 1; j >= first; j--)
+    stack[a->top++] = j;
+}
+
+/****************************************************************************************/
+/* take a free ID, -1 if there is none                                                  */
+static int idalloc_Get(MXP_ID_ALLOC_T *a)
+{
+  int id;
+
+  if (mxp_id_lifo){
+    if (a->top == 0)
+      return -1;
+    id = a->stack[--a->top];
+  } else {
+    id = find_first_zero_bit(a->map, a->max);
+    if (id >= a->max)
+      return -1;
+  }
+
+  __set_bit(id, a->map);
+  return id;
+}
+
+/****************************************************************************************/
+/* give an ID back; an ID that is not in use is ignored                                 */
+static void idalloc_Put(MXP_ID_ALLOC_T *a, int id)
+{
+  if ((id < 0) || (id >= a->max) || !test_bit(id, a->map))
+    return;
+
+  __clear_bit(id, a->map);
+  if (mxp_id_lifo)
+    a->stack[a->top++] = id;
+}
@@ -0,0 +1,568 @@
+/*
+ * File name: mmxp_lwt.c
+ *
+ * Description: This is part of mxp module implemented the kernel side of the
+ *              event driven lightweight threads (XthCreate). It must be
+ *              included into mmxpcore.c and is moved to separate file to be
+ *              readable only.
+ *
+ * Copyright (C) 2008 Texas Instruments, Incorporated
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2.
+ *
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any kind,
+ * whether express or implied; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+   A lightweight thread is a state machine that one MXP task runs: the task
+   calls its event function whenever posted events satisfy the thread's event
+   mask and its sleep-done function when an XthSleep is over.
+   The kernel keeps the event mask, the posted events and the sleep timer of
+   every thread. A thread that becomes runnable is put on the ready list of its
+   task (mxp_subtcb[tid].lwt_head) and the task is woken if the list was empty.
+   The task takes a batch of runnable threads and the events that triggered
+   them with one MXP_LWT_RUN, so one thread of the OS serves any number of
+   them with one system call per dispatch round.
+   A sleeping thread is not run for its events; they stay posted and are
+   reported together with the end of the sleep.
+   The fields of a thread and the ready list are guarded by the lock of the
+   task that runs it; lwt_table_lock only guards threads going busy or free.
+*/
+static MXP_LWT_T           mlwt[MAX_LWTHREADS];
+
+static DEFINE_SPINLOCK(lwt_table_lock);
+
+/* lightweight thread ID allocator */
+static MXP_ID_ALLOC_T      lwt_ids;
+static DECLARE_BITMAP(lwt_ids_map, MAX_LWTHREADS);
+static short               lwt_ids_stack[MAX_LWTHREADS];
+
+/*********************************************************************************
+* FUNCTION: lwt_Init
+*
+* DESCRIPTION: Initialize lightweight thread pull
+*********************************************************************************/
+void lwt_Init(void)
+{
+  memset(mlwt, 0, sizeof(mlwt));
+  mlwt[0].state = 1; /* we don't use thread #0, it ends the ready lists */
+  idalloc_Init(&lwt_ids, lwt_ids_map, lwt_ids_stack, MAX_LWTHREADS, 1);
+}
+
+/* lock the task that runs thread lwid, returns 0 (and leaves it unlocked) if
+   there is no such thread */
+static int lwt_lock(int lwid, unsigned long *fl)
+{
+  int tid;
+
+  if ((lwid <= 0) || (lwid >= MAX_LWTHREADS))
+    return 0;
+
+  tid = mlwt[lwid].tid;
+  if (!tcb_lock(tid, fl))
+    return 0;
+
+  /* the thread may have been deleted (or given to another task) meanwhile */
+  if (mlwt[lwid].state && (mlwt[lwid].tid == tid))
+    return 1;
+
+  TCB_UNLOCK(tid, *fl);
+  return 0;
+}
+
+/* posted events of thread t satisfy its event mask */
+static inline int lwt_match(MXP_LWT_T *t)
+{
+  if (t->events_condition == MX_AND_COND)
+    return (t->events_mask != 0) && ((t->events_posted & t->events_mask) == t->events_mask);
+
+  return ((t->events_posted & t->events_mask) != 0);
+}
+
+/* put thread lwid on the ready list of its task if it is runnable, returns
+   nonzero if the task has to be woken; the task lock is held */
+static int lwt_check(int lwid)
+{
+  MXP_LWT_T    *t  = &mlwt[lwid];
+  MXP_SUBTCB_T *st = &mxp_subtcb[t->tid];
+
+  if (t->queued || !(t->woke || (!t->sleeping && lwt_match(t))))
+    return 0;
+
+  t->queued = 1;
+  t->next   = 0;
+  if (st->lwt_tail)
+    mlwt[st->lwt_tail].next = lwid;
+  else
+    st->lwt_head = lwid;
+  st->lwt_tail = lwid;
+
+  return (st->lwt_ready++ == 0);
+}
+
+/* take thread lwid off the ready list of its task; the task lock is held */
+static void lwt_unqueue(int lwid)
+{
+  MXP_SUBTCB_T *st = &mxp_subtcb[mlwt[lwid].tid];
+  short *link = &(st->lwt_head);
+  short prev  = 0;
+
+  if (!mlwt[lwid].queued)
+    return;
+
+  while (*link){
+    if (*link == lwid){
+      *link = mlwt[lwid].next;
+      if (st->lwt_tail == lwid)
+        st->lwt_tail = prev;
+      st->lwt_ready--;
+      mlwt[lwid].queued = 0;
+      return;
+    }
+    prev = *link;
+    link = &(mlwt[*link].next);
+  }
+}
+
+/* cancel the sleep of thread lwid; the task lock is held */
+static void lwt_stopSleep(int lwid)
+{
+  if (!mlwt[lwid].sleeping)
+    return;
+
+  spin_lock(&tmr_base_lock);
+  if (mlwt[lwid].tmrobj._index > 0)
+    tmrobj_Delete(&(mlwt[lwid].tmrobj));
+  spin_unlock(&tmr_base_lock);
+  mlwt[lwid].sleeping = 0;
+}
+
+/* free thread lwid; lwt_table_lock and the task lock are held */
+static void lwt_release(int lwid)
+{
+  lwt_unqueue(lwid);
+  lwt_stopSleep(lwid);
+  mlwt[lwid].state = 0;
+  idalloc_Put(&lwt_ids, lwid);
+}
+
+/*********************************************************************************
+* FUNCTION: lwt_freeTask
+*
+* DESCRIPTION: free the lightweight threads of task tid, the task is being freed
+*              and must not be locked by tcb_lock any more
+*********************************************************************************/
+static void lwt_freeTask(int tid)
+{
+  unsigned long irq_st;
+  int lwid;
+
+  spin_lock_irqsave(&lwt_table_lock, irq_st);
+  spin_lock(&(mxp_subtcb[tid].lock));
+
+  for (lwid = 1; lwid < MAX_LWTHREADS; lwid++)
+    if (mlwt[lwid].state && (mlwt[lwid].tid == tid))
+      lwt_release(lwid);
+
+  mxp_subtcb[tid].lwt_head  = 0;
+  mxp_subtcb[tid].lwt_tail  = 0;
+  mxp_subtcb[tid].lwt_ready = 0;
+
+  spin_unlock(&(mxp_subtcb[tid].lock));
+  spin_unlock_irqrestore(&lwt_table_lock, irq_st);
+
+  /* an MXP_LWT_RUN of the task returns */
+  wake_up(&(mxp_subtcb[tid].gate_lock));
+}
+
+/*********************************************************************************
+* FUNCTION: lwt_wakeup
+*
+* DESCRIPTION: timer management calls the function when a thread sleep is over
+*********************************************************************************/
+static void lwt_wakeup(struct TMROBJ_tag *this)
+{
+  unsigned long irq_st;
+  int lwid = (int)(this->owner);
+  int tid;
+  int restarted;
+  int wake = 0;
+
+  if (!lwt_lock(lwid, &irq_st))
+    return;
+  tid = mlwt[lwid].tid;
+
+  /* a new XthSleep may have started the timer object again meanwhile */
+  spin_lock(&tmr_base_lock);
+  restarted = (this->_index > 0);
+  spin_unlock(&tmr_base_lock);
+
+  if (mlwt[lwid].sleeping && !restarted){
+    mlwt[lwid].sleeping = 0;
+    mlwt[lwid].woke     = 1;
+    wake = lwt_check(lwid);
+  }
+
+  TCB_UNLOCK(tid, irq_st);
+  if (wake)
+    wake_up(&(mxp_subtcb[tid].gate_lock));
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_lwt_create
+*
+* DESCRIPTION: create a thread run by task tid, it starts with an empty mask
+*********************************************************************************/
+static int mxp_lwt_create(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int tid = msg->cp.lwt.tid;
+  int lwid;
+
+  spin_lock_irqsave(&lwt_table_lock, irq_st);
+
+  if ((lwid = idalloc_Get(&lwt_ids)) < 0){
+    spin_unlock_irqrestore(&lwt_table_lock, irq_st);
+    return ERR_NOTCB;
+  }
+
+  if ((tid <= 0) || (tid >= MXP_TASK_MAX) || !mxp_tcb[tid].busy){
+    idalloc_Put(&lwt_ids, lwid);
+    spin_unlock_irqrestore(&lwt_table_lock, irq_st);
+    return ERR_TIDINV;
+  }
+
+  spin_lock(&(mxp_subtcb[tid].lock));
+  memset(&mlwt[lwid], 0, sizeof(MXP_LWT_T));
+  mlwt[lwid].tid              = tid;
+  mlwt[lwid].events_condition = MX_OR_COND;
+  mlwt[lwid].state            = 1;
+  spin_unlock(&(mxp_subtcb[tid].lock));
+
+  msg->cp.lwt.lwid = lwid;
+
+  spin_unlock_irqrestore(&lwt_table_lock, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_lwt_delete
+*
+* DESCRIPTION:
+*********************************************************************************/
+static int mxp_lwt_delete(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int lwid = msg->cp.lwt.lwid;
+  int tid;
+
+  spin_lock_irqsave(&lwt_table_lock, irq_st);
+
+  if ((lwid <= 0) || (lwid >= MAX_LWTHREADS) || (mlwt[lwid].state == 0)){
+    spin_unlock_irqrestore(&lwt_table_lock, irq_st);
+    return ERR_TIDINV;
+  }
+
+  tid = mlwt[lwid].tid;
+  spin_lock(&(mxp_subtcb[tid].lock));
+  lwt_release(lwid);
+  spin_unlock(&(mxp_subtcb[tid].lock));
+
+  spin_unlock_irqrestore(&lwt_table_lock, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_lwt_setmask
+*
+* DESCRIPTION: set the events the thread waits for, it runs as soon as the
+*              events posted already satisfy them
+*********************************************************************************/
+static int mxp_lwt_setmask(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int lwid = msg->cp.lwt.lwid;
+  int tid;
+  int wake;
+
+  if (!lwt_lock(lwid, &irq_st))
+    return ERR_TIDINV;
+  tid = mlwt[lwid].tid;
+
+  mlwt[lwid].events_mask      = msg->cp.lwt.events;
+  mlwt[lwid].events_condition = msg->cp.lwt.condition;
+  wake = lwt_check(lwid);
+
+  TCB_UNLOCK(tid, irq_st);
+  if (wake)
+    wake_up(&(mxp_subtcb[tid].gate_lock));
+
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_lwt_sleep
+*
+* DESCRIPTION: put a thread to sleep for timeout ticks, a sleep in progress is
+*              replaced
+*********************************************************************************/
+static int mxp_lwt_sleep(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int lwid = msg->cp.lwt.lwid;
+  int tid;
+
+  if (!lwt_lock(lwid, &irq_st))
+    return ERR_TIDINV;
+  tid = mlwt[lwid].tid;
+
+  lwt_unqueue(lwid);
+  lwt_stopSleep(lwid);
+  mlwt[lwid].woke     = 0;
+  mlwt[lwid].sleeping = 1;
+
+  spin_lock(&tmr_base_lock);
+  tmrobj_Start(&(mlwt[lwid].tmrobj), msg->cp.lwt.timeout, lwt_wakeup, (void*)lwid);
+  spin_unlock(&tmr_base_lock);
+
+  TCB_UNLOCK(tid, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_lwt_post
+*
+* DESCRIPTION: post events to a thread
+*********************************************************************************/
+static int mxp_lwt_post(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int lwid = msg->cp.lwt.lwid;
+  int tid;
+  int wake;
+
+  if (!lwt_lock(lwid, &irq_st))
+    return ERR_TIDINV;
+  tid = mlwt[lwid].tid;
+
+  mlwt[lwid].events_posted |= msg->cp.lwt.events;
+  wake = lwt_check(lwid);
+
+  TCB_UNLOCK(tid, irq_st);
+  if (wake)
+    wake_up(&(mxp_subtcb[tid].gate_lock));
+
+  return ERR_NOERR;
+}
+
+/**********************************************************************
+* FUNCTION: mxp_lwt_post_by_id
+*
+* DESCRIPTION: Kernel API to post events to a lightweight thread, e.g.
+* from the interrupt handler of a channel
+**********************************************************************/
+int mxp_lwt_post_by_id(int lwid, unsigned long events)
+{
+    MXP_CMD_T   msg;
+
+    msg.cp.lwt.lwid   = lwid;
+    msg.cp.lwt.events = events;
+
+    return ( mxp_lwt_post(&msg) );
+}
+
+EXPORT_SYMBOL(mxp_lwt_post_by_id);
+
+/* move up to count runnable threads of task tid to run[], returns the number
+   moved; the task lock is held */
+static int lwt_take(int tid, MXP_LWT_RUN_T *run, int count)
+{
+  MXP_SUBTCB_T *st = &mxp_subtcb[tid];
+  MXP_LWT_T    *t;
+  int n = 0;
+  int lwid;
+
+  while ((n < count) && st->lwt_head){
+    lwid = st->lwt_head;
+    t    = &mlwt[lwid];
+
+    st->lwt_head = t->next;
+    if (st->lwt_head == 0)
+      st->lwt_tail = 0;
+    st->lwt_ready--;
+    t->queued = 0;
+
+    run[n].lwid   = lwid;
+    run[n].why    = 0;
+    run[n].events = 0;
+    if (t->woke){
+      t->woke = 0;
+      run[n].why |= MXP_LWT_WOKE;
+    }
+    if (!t->sleeping && lwt_match(t)){
+      run[n].events     = t->events_posted & t->events_mask;
+      t->events_posted &= ~run[n].events;
+      run[n].why       |= MXP_LWT_EVENT;
+    }
+
+    /* the mask may have changed since the thread was queued */
+    if (run[n].why){
+      t->runs++;
+      n++;
+    }
+  }
+
+  return n;
+}
+
+/* give the threads taken by lwt_take back to task tid, their events and wakeups
+   are posted again; the task lock is held. The task itself is the caller, so
+   nobody has to be woken */
+static void lwt_untake(int tid, MXP_LWT_RUN_T *run, int n)
+{
+  MXP_LWT_T *t;
+  int j;
+
+  for (j = 0; j < n; j++){
+    t = &mlwt[run[j].lwid];
+    /* the thread may have been deleted meanwhile */
+    if (!t->state || (t->tid != tid))
+      continue;
+
+    t->events_posted |= run[j].events;
+    if (run[j].why & MXP_LWT_WOKE)
+      t->woke = 1;
+    t->runs--;
+    lwt_check(run[j].lwid);
+  }
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_lwt_run
+*
+* DESCRIPTION: wait up to timeout ticks until some thread of the calling task is
+*              runnable and return the runnable threads with their events;
+*              the events returned are taken from the threads
+*********************************************************************************/
+static int mxp_lwt_run(MXP_CMD_T*  msg)
+{
+  MXP_LWT_RUN_T run[MXP_LWT_RUN_MAX];
+  unsigned long irq_st;
+  int tid   = msg->cp.lwt.tid;
+  int count = msg->cp.lwt.count;
+  int n;
+  long jif;
+  long ret;
+
+  msg->cp.lwt.count = 0;
+  if ((count <= 0) || (msg->cp.lwt.run == NULL))
+    return ERR_NULLPTR;
+  if (count > MXP_LWT_RUN_MAX)
+    count = MXP_LWT_RUN_MAX;
+
+  if (!tcb_lock(tid, &irq_st))
+    return ERR_TIDINV;
+  /* only the thread of the task runs its lightweight threads */
+  if (mxp_subtcb[tid].task != current){
+    TCB_UNLOCK(tid, irq_st);
+    return ERR_TIDINV;
+  }
+  n = lwt_take(tid, run, count);
+  TCB_UNLOCK(tid, irq_st);
+
+  if ((n == 0) && (msg->cp.lwt.timeout != MX_NO_BLOCK)){
+    if (msg->cp.lwt.timeout == MX_INDEFINITE)
+      jif = MAX_SCHEDULE_TIMEOUT;
+    else
+      jif = (msg->cp.lwt.timeout * HZ + GG_TICKS_PER_SEC - 1) / GG_TICKS_PER_SEC;
+
+    ret = wait_event_interruptible_timeout(mxp_subtcb[tid].gate_lock,
+                     (mxp_subtcb[tid].lwt_ready != 0) || !mxp_tcb[tid].busy, jif);
+    if (ret == -ERESTARTSYS){
+      printk( KERN_INFO "mxp_lwt_run for task %d waken up by unexpected signal\n", tid);
+      return SYS_CONFIG_ERR;
+    }
+
+    if (!tcb_lock(tid, &irq_st))
+      return ERR_TIDINV;
+    n = lwt_take(tid, run, count);
+    TCB_UNLOCK(tid, irq_st);
+  }
+
+  if (n == 0)
+    return ((msg->cp.lwt.timeout == MX_NO_BLOCK) ? ERR_NOEVT : ERR_TIMEOUT);
+
+  if (copy_to_user((void __user *)msg->cp.lwt.run, run, n * sizeof(MXP_LWT_RUN_T))){
+    /* the caller never sees them, so the threads must not lose their events */
+    if (tcb_lock(tid, &irq_st)){
+      lwt_untake(tid, run, n);
+      TCB_UNLOCK(tid, irq_st);
+    }
+    return ERR_NULLPTR;
+  }
+
+  msg->cp.lwt.count = n;
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_lwt_inquiry
+*
+* DESCRIPTION: get the task, the pending events and the sleep state of a thread
+*********************************************************************************/
+static int mxp_lwt_inquiry(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int lwid = msg->cp.lwt.lwid;
+  int tid;
+
+  if (!lwt_lock(lwid, &irq_st))
+    return ERR_TIDINV;
+  tid = mlwt[lwid].tid;
+
+  msg->cp.lwt.tid       = tid;
+  msg->cp.lwt.events    = mlwt[lwid].events_posted;
+  msg->cp.lwt.condition = mlwt[lwid].events_condition;
+  msg->cp.lwt.sleeping  = mlwt[lwid].sleeping;
+
+  TCB_UNLOCK(tid, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_lwt_proc
+*
+* DESCRIPTION: form the output for /proc/timxp/lwt file
+*********************************************************************************/
+static int mxp_lwt_proc(char *buf, char **start, off_t offset,
+                   int count, int *eof, void *data)
+{
+  int len = 0;
+  int i;
+
+  len += sprintf(buf + len, "  id task       mask     posted cond state        runs\n");
+  for (i = 1; i < MAX_LWTHREADS; i++){
+    if (mlwt[i].state == 0)
+      continue;
+
+    /* the output of one page holds about 70 threads */
+    if (len > PAGE_SIZE - 80){
+      len += sprintf(buf + len, "...\n");
+      break;
+    }
+
+    len += sprintf(buf + len, "%4d %4d %08lx %08lx %4s %-8s %8lu\n", i, mlwt[i].tid,
+                   mlwt[i].events_mask, mlwt[i].events_posted,
+                   (mlwt[i].events_condition == MX_AND_COND) ? "and" : "or",
+                   mlwt[i].sleeping ? "sleep" : (mlwt[i].queued ? "ready" : "wait"),
+                   mlwt[i].runs);
+  }
+
+  *eof = 1;
+  return len;
+}
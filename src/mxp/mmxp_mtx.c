@@ -0,0 +1,398 @@
+/*
+ * File name: mmxp_mtx.c
+ *
+ * Description: This is part of mxp module implemented priority inheritance
+ *              mutexes. It must be included into mmxpcore.c after mmxp_sem.c
+ *              and is moved to separate file to be readable only.
+ *
+ * Copyright (C) 2008 Texas Instruments, Incorporated
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2.
+ *
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any kind,
+ * whether express or implied; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+   The owner of mutex mid is the word mutex[mid] of the shared page: the MXP
+   task id of the owner, 0 while unlocked. An uncontended lock is a
+   compare-and-swap 0 -> tid and an uncontended unlock tid -> 0, both in user
+   space. A locker that finds the mutex taken enters the kernel
+   (MXP_MUTEX_LOCK), sets MXP_MUTEX_WAITERS in the word so that the owner's
+   unlock fails in user space and comes to the kernel too (MXP_MUTEX_UNLOCK),
+   and sleeps.
+   Before it sleeps a waiter with a higher MXP priority than the owner boosts
+   the owner thread to the scheduling policy of its own priority (the same
+   mapping MXP_TASK_SETPRIO uses); the unlock in the kernel puts the owner back
+   to the highest boost it still gets from the other mutexes it holds, or to
+   the policy of its own MXP priority. So a low priority task holding a mutex
+   runs at the priority of the most urgent task waiting for it.
+   Every mutex records the boost of its owner in boost_tid/boost_prio. The
+   priority change itself may sleep and is done with the mutex lock dropped,
+   under mtx_prio_lock: it always applies the highest boost recorded for the
+   task at that moment, so a boost that lost the race with an unlock can not
+   outlive it and an unlock can not drop a boost of another mutex.
+   The kernel rt_mutex can not carry this: it would have to be locked on
+   behalf of the user space owner, and the proxy lock calls the futex code
+   uses for that are not exported to modules.
+*/
+static MXP_MUTEX_T         mmutex[MAX_MUTEXES];
+
+/* mtx_table_lock guards the state of every mutex going busy or free */
+static DEFINE_SPINLOCK(mtx_table_lock);
+
+/* mutex name index */
+static MXP_NAME_IDX_T      mtx_names;
+static short               mtx_names_next[MAX_MUTEXES];
+
+/* mutex ID allocator */
+static MXP_ID_ALLOC_T      mtx_ids;
+static DECLARE_BITMAP(mtx_ids_map, MAX_MUTEXES);
+static short               mtx_ids_stack[MAX_MUTEXES];
+
+/* orders the priority changes of mutex owners */
+static DEFINE_MUTEX(mtx_prio_lock);
+
+#define MTX_WORD(mid)      ((atomic_t*)&(mxp_shm->mutex[mid]))
+#define MTX_INVALID(mid)   (((mid) <= 0) || ((mid) >= MAX_MUTEXES) || (mmutex[mid].state == 0))
+
+#define MTX_LOCK(mid, fl)    spin_lock_irqsave(&(mmutex[mid].lock), fl)
+#define MTX_UNLOCK(mid, fl)  spin_unlock_irqrestore(&(mmutex[mid].lock), fl)
+
+/*********************************************************************************
+* FUNCTION: mtx_Init
+*
+* DESCRIPTION: Initialize mutex pull, the shared page must be there already
+*********************************************************************************/
+void mtx_Init(void)
+{
+  int j;
+
+  memset(mmutex, 0, sizeof(mmutex));
+  for (j = 0; j < MAX_MUTEXES; j++){
+    spin_lock_init(&(mmutex[j].lock));
+    init_waitqueue_head(&(mmutex[j].wait));
+  }
+  mmutex[0].state = 1; /* we don't use mutex #0 */
+
+  nidx_Init(&mtx_names, mtx_names_next, mmutex, sizeof(MXP_MUTEX_T),
+            offsetof(MXP_MUTEX_T, name), MAX_MUTEXES);
+  idalloc_Init(&mtx_ids, mtx_ids_map, mtx_ids_stack, MAX_MUTEXES, 1);
+}
+
+/* run the thread of task tid with the policy of MXP priority prio */
+static void mtx_setPrio(int tid, int prio)
+{
+  struct task_struct *p;
+
+  if ((p = tcb_task(tid)) == NULL)
+    return;
+
+  tcb_applyPrio(p, prio, 0);
+  put_task_struct(p);
+}
+
+/* put task tid to the highest boost recorded for it by the mutexes it holds,
+   to its own MXP priority if there is none; called under mtx_prio_lock */
+static void mtx_reprio(int tid)
+{
+  unsigned long irq_st;
+  int prio = mxp_tcb[tid].priority;
+  int j;
+
+  for (j = 1; j < MAX_MUTEXES; j++){
+    if (mmutex[j].boost_tid != tid)
+      continue;
+    MTX_LOCK(j, irq_st);
+    if (mmutex[j].state && (mmutex[j].boost_tid == tid) && (mmutex[j].boost_prio > prio))
+      prio = mmutex[j].boost_prio;
+    MTX_UNLOCK(j, irq_st);
+  }
+
+  mtx_setPrio(tid, prio);
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_mtx_create
+*
+* DESCRIPTION:
+*********************************************************************************/
+static int mxp_mtx_create(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int mid;
+
+  spin_lock_irqsave(&mtx_table_lock, irq_st);
+
+  /* check whether the named mutex already exists */
+  if (nidx_Find(&mtx_names, msg->cp.mtx.name) != -1){
+    spin_unlock_irqrestore(&mtx_table_lock, irq_st);
+    return ERR_ASGN;
+  }
+
+  if ((mid = idalloc_Get(&mtx_ids)) < 0){
+    spin_unlock_irqrestore(&mtx_table_lock, irq_st);
+    return ERR_NOSCB;
+  }
+
+  spin_lock(&(mmutex[mid].lock));
+  mmutex[mid].state      = 1;
+  mmutex[mid].waiters    = 0;
+  mmutex[mid].boost_tid  = 0;
+  mmutex[mid].contended  = 0;
+  strcpy(mmutex[mid].name, msg->cp.mtx.name);
+  nidx_Insert(&mtx_names, mid);
+  atomic_set(MTX_WORD(mid), 0);
+  spin_unlock(&(mmutex[mid].lock));
+
+  msg->cp.mtx.mid = mid;
+
+  spin_unlock_irqrestore(&mtx_table_lock, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_mtx_delete
+*
+* DESCRIPTION: the tasks waiting on the mutex return ERR_SUNASGN, a boosted
+*              owner is put back to its own priority
+*********************************************************************************/
+static int mxp_mtx_delete(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int mid = msg->cp.mtx.mid;
+  int unboost;
+
+  spin_lock_irqsave(&mtx_table_lock, irq_st);
+  if (MTX_INVALID(mid)){
+    spin_unlock_irqrestore(&mtx_table_lock, irq_st);
+    return ERR_SIDINV;
+  }
+
+  spin_lock(&(mmutex[mid].lock));
+  nidx_Remove(&mtx_names, mid);
+  mmutex[mid].state = 0;
+  mmutex[mid].gen++;
+  unboost = mmutex[mid].boost_tid;
+  mmutex[mid].boost_tid = 0;
+  spin_unlock(&(mmutex[mid].lock));
+  idalloc_Put(&mtx_ids, mid);
+
+  spin_unlock_irqrestore(&mtx_table_lock, irq_st);
+  wake_up(&(mmutex[mid].wait));
+  if (unboost){
+    mutex_lock(&mtx_prio_lock);
+    mtx_reprio(unboost);
+    mutex_unlock(&mtx_prio_lock);
+  }
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_mtx_identify
+*
+* DESCRIPTION: find mid by name
+*********************************************************************************/
+static int mxp_mtx_identify(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int ret = ERR_NOERR;
+
+  spin_lock_irqsave(&mtx_table_lock, irq_st);
+
+  if ((msg->cp.mtx.mid = nidx_Find(&mtx_names, msg->cp.mtx.name)) == -1)
+    ret = ERR_INVNAME;
+
+  spin_unlock_irqrestore(&mtx_table_lock, irq_st);
+  return ret;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_mtx_lock
+*
+* DESCRIPTION: lock the mutex for task tid (the calling thread), sleep up to
+*              timeout ticks for it and boost the owner meanwhile
+*********************************************************************************/
+static int mxp_mtx_lock(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  MXP_MUTEX_T *m;
+  int mid = msg->cp.mtx.mid;
+  int tid = msg->cp.mtx.tid;
+  int prio, owner, v;
+  int boost;
+  unsigned int gen;
+  long jif;
+  long ret;
+
+  if (MTX_INVALID(mid))
+    return ERR_SIDINV;
+  if ((tid <= 0) || (tid >= MXP_TASK_MAX) || (mxp_subtcb[tid].task != current))
+    return ERR_TIDINV;
+  m = &mmutex[mid];
+
+  if (atomic_cmpxchg(MTX_WORD(mid), 0, tid) == 0)
+    return ERR_NOERR;
+
+  if (MXP_MUTEX_OWNER(atomic_read(MTX_WORD(mid))) == tid)
+    return SYS_ILLEGAL_REQUEST; /* not recursive */
+
+  if (msg->cp.mtx.timeout == MX_NO_BLOCK)
+    return ERR_NOSEM;
+
+  if (msg->cp.mtx.timeout == MX_INDEFINITE)
+    jif = MAX_SCHEDULE_TIMEOUT;
+  else
+    jif = (msg->cp.mtx.timeout * HZ + GG_TICKS_PER_SEC - 1) / GG_TICKS_PER_SEC;
+
+  prio = mxp_tcb[tid].priority;
+
+  MTX_LOCK(mid, irq_st);
+  gen = m->gen;
+  m->waiters++;
+  m->contended++;
+  while (1){
+    v = atomic_read(MTX_WORD(mid));
+    owner = MXP_MUTEX_OWNER(v);
+    if (owner == 0){
+      /* free: take it, keep the flag up for the other waiters */
+      if (atomic_cmpxchg(MTX_WORD(mid), v, tid | ((m->waiters > 1) ? MXP_MUTEX_WAITERS : 0)) == v)
+        break;
+      continue;
+    }
+
+    /* make the owner's unlock come here */
+    if (!(v & MXP_MUTEX_WAITERS) &&
+        (atomic_cmpxchg(MTX_WORD(mid), v, v | MXP_MUTEX_WAITERS) != v))
+      continue;
+
+    /* the word is writable by user space, boost only a task that exists */
+    boost = 0;
+    if ((owner < MXP_TASK_MAX) && mxp_tcb[owner].busy &&
+        (prio > mxp_tcb[owner].priority) &&
+        ((m->boost_tid != owner) || (prio > m->boost_prio))){
+      m->boost_tid  = owner;
+      m->boost_prio = prio;
+      boost = owner;
+    }
+    MTX_UNLOCK(mid, irq_st);
+
+    if (boost){
+      /* the owner may have unlocked (and unboosted) or got a higher boost
+         since; apply whatever is recorded for it now */
+      mutex_lock(&mtx_prio_lock);
+      mtx_reprio(boost);
+      mutex_unlock(&mtx_prio_lock);
+    }
+
+    ret = wait_event_interruptible_timeout(m->wait, (m->gen != gen) ||
+                   (MXP_MUTEX_OWNER(atomic_read(MTX_WORD(mid))) == 0), jif);
+
+    MTX_LOCK(mid, irq_st);
+    if (m->gen != gen){
+      MTX_UNLOCK(mid, irq_st);
+      return ERR_SUNASGN;
+    }
+    if ((ret == 0) || (ret == -ERESTARTSYS)){
+      m->waiters--;
+      MTX_UNLOCK(mid, irq_st);
+      if (ret == 0)
+        return ERR_TIMEOUT;
+      printk( KERN_INFO "mxp_mtx_lock for mutexId %d waken up by unexpected signal\n", mid);
+      return SYS_CONFIG_ERR;
+    }
+    if (jif != MAX_SCHEDULE_TIMEOUT)
+      jif = ret;
+  }
+  m->waiters--;
+  MTX_UNLOCK(mid, irq_st);
+
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_mtx_trylock
+*
+* DESCRIPTION: lock the mutex for task tid if it is free
+*********************************************************************************/
+static int mxp_mtx_trylock(MXP_CMD_T*  msg)
+{
+  msg->cp.mtx.timeout = MX_NO_BLOCK;
+  return mxp_mtx_lock(msg);
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_mtx_unlock
+*
+* DESCRIPTION: task tid (the calling thread) gives the mutex up; it drops a boost
+*              and wakes the waiters
+*********************************************************************************/
+static int mxp_mtx_unlock(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  MXP_MUTEX_T *m;
+  int mid = msg->cp.mtx.mid;
+  int tid = msg->cp.mtx.tid;
+  int unboost = 0;
+  int wake;
+
+  if (MTX_INVALID(mid))
+    return ERR_SIDINV;
+  if ((tid <= 0) || (tid >= MXP_TASK_MAX) || (mxp_subtcb[tid].task != current))
+    return ERR_TIDINV;
+  m = &mmutex[mid];
+
+  MTX_LOCK(mid, irq_st);
+  if (MXP_MUTEX_OWNER(atomic_read(MTX_WORD(mid))) != tid){
+    MTX_UNLOCK(mid, irq_st);
+    return SYS_ILLEGAL_REQUEST; /* not the owner */
+  }
+
+  if (m->boost_tid == tid){
+    unboost = tid;
+    m->boost_tid = 0;
+  }
+  atomic_xchg(MTX_WORD(mid), 0); /* full barrier */
+  wake = m->waiters;
+  MTX_UNLOCK(mid, irq_st);
+
+  if (wake)
+    wake_up(&(m->wait));
+  if (unboost){
+    mutex_lock(&mtx_prio_lock);
+    mtx_reprio(unboost);
+    mutex_unlock(&mtx_prio_lock);
+  }
+
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_mutex_proc
+*
+* DESCRIPTION: form the output for /proc/timxp/mutex file
+*********************************************************************************/
+static int mxp_mutex_proc(char *buf, char **start, off_t offset,
+                   int count, int *eof, void *data)
+{
+  int len = 0;
+  int i, v;
+
+  len += sprintf(buf + len, " id name             owner waiters boosted contended\n");
+  for (i = 1; i < MAX_MUTEXES; i++){
+    if (mmutex[i].state == 0)
+      continue;
+
+    v = atomic_read(MTX_WORD(i));
+    len += sprintf(buf + len, "%3d %-16s %5d %7d %7d %9lu\n", i, mmutex[i].name,
+                   MXP_MUTEX_OWNER(v), mmutex[i].waiters, mmutex[i].boost_tid,
+                   mmutex[i].contended);
+  }
+
+  *eof = 1;
+  return len;
+}
@@ -0,0 +1,111 @@
+/*
+ * File name: mmxp_name.c
+ *
+ * Description: Hashed name index of MXP objects (tasks, queues, segments).
+ *              It must be included into mmxpcore.c and mmxpmem.c and is moved
+ *              to separate file to be shared by both modules.
+ *
+ * Copyright (C) 2008 Texas Instruments, Incorporated
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2.
+ *
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any kind,
+ * whether express or implied; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+   An index keeps the named objects of one control block array in hash chains.
+   The chains are linked through a next[] array indexed by the object id, so
+   the index needs no memory besides the bucket heads and next[]; the name
+   itself stays in the control block, found by its offset.
+   The caller holds the table lock of the objects around every index call;
+   a lookup only walks one short chain.
+*/
+#define MXP_NAME_HASH_SIZE  64   /* power of 2 */
+#define MXP_NAME_NIL        (-1)
+
+typedef struct {
+  short           head[MXP_NAME_HASH_SIZE];
+  short           *next;    /* max entries, the chain link of every object */
+  char            *base;    /* control block array */
+  int             stride;   /* size of a control block */
+  int             offset;   /* offset of the name in a control block */
+  int             max;
+} MXP_NAME_IDX_T;
+
+#define NIDX_NAME(idx, id)  ((idx)->base + (id) * (idx)->stride + (idx)->offset)
+
+/****************************************************************************************/
+/* hash of a name, at most MAX_NAME_LEN characters are taken                            */
+static inline unsigned int nidx_Hash(const char *name)
+{
+  unsigned int h = 5381;
+  int j;
+
+  for (j = 0; (j < MAX_NAME_LEN) && name[j]; j++)
+    h = (h * 33) ^ (unsigned char)name[j];
+
+  return h & (MXP_NAME_HASH_SIZE - 1);
+}
+
+/****************************************************************************************/
+/* set up an empty index over max control blocks starting at base                       */
+static void nidx_Init(MXP_NAME_IDX_T *idx, short *next, void *base,
+                      int stride, int offset, int max)
+{
+  int j;
+
+  for (j = 0; j < MXP_NAME_HASH_SIZE; j++)
+    idx->head[j] = MXP_NAME_NIL;
+  for (j = 0; j < max; j++)
+    next[j] = MXP_NAME_NIL;
+
+  idx->next   = next;
+  idx->base   = (char*)base;
+  idx->stride = stride;
+  idx->offset = offset;
+  idx->max    = max;
+}
+
+/****************************************************************************************/
+/* returns the id of the object with the given name, -1 if there is none               */
+static int nidx_Find(MXP_NAME_IDX_T *idx, const char *name)
+{
+  int id;
+
+  for (id = idx->head[nidx_Hash(name)]; id != MXP_NAME_NIL; id = idx->next[id])
+    if (!strncmp(NIDX_NAME(idx, id), name, MAX_NAME_LEN))
+      return id;
+
+  return -1;
+}
+
+/****************************************************************************************/
+/* add object id, its name must already be set in the control block                     */
+static void nidx_Insert(MXP_NAME_IDX_T *idx, int id)
+{
+  unsigned int h = nidx_Hash(NIDX_NAME(idx, id));
+
+  idx->next[id] = idx->head[h];
+  idx->head[h]  = id;
+}
+
+/****************************************************************************************/
+/* remove object id, before its name is changed                                         */
+static void nidx_Remove(MXP_NAME_IDX_T *idx, int id)
+{
+  short *link = &(idx->head[nidx_Hash(NIDX_NAME(idx, id))]);
+
+  while (*link != MXP_NAME_NIL){
+    if (*link == id){
+      *link = idx->next[id];
+      idx->next[id] = MXP_NAME_NIL;
+      return;
+    }
+    link = &(idx->next[*link]);
+  }
+}
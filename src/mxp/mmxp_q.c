@@ -18,86 +18,233 @@
  */
 
 /*
-   Queue management operates with pull of message containers and pull of queues.
-   At the beginning all containers linked into the dual linked list. The list refered
-   by two pinters freeHead and freeTail.
-   Each queue also has two pointers. When queue needs a container it remove the first
-   free pinted by freeHead and add it to the tail of the queue. When the queue release
-   the message it return the container to the tail of the free list
+   Every queue owns its message storage: a pool of depth entries allocated by
+   mxp_q_create, shared by all priority levels. Each level is a FIFO list of
+   entries linked through next[], the free entries are another list, so the
+   storage does not grow with the number of levels. Post and wait only move
+   list links, and a busy queue can no longer use up the storage of the others.
+   A queue may be created with several priority levels (up to MXP_QUEUE_MAX_LEVELS).
+   lvlmask has bit N set while level N is not empty, so the highest pending level
+   is found with a single fls().
+   Level 0 is the lowest priority; a jammed message goes to the head of its level.
+   A copy-mode queue (created with msgsize > 0) carries the message bytes instead
+   of a pointer. Its payload store has one fixed size slot per queue entry; the
+   entry then holds the slot index. The poster copies straight from its buffer
+   into a reserved slot and the receiver copies straight out of it, both with
+   interrupts enabled, so the store is reference counted: a queue deleted while a
+   copy is in flight frees the store when that copy is finished.
+   A conflating queue (MXP_QUEUE_CONFLATE) also keeps the key of every pending
+   message. A post whose key is already pending replaces that message in place,
+   so the queue never holds more than one message per key.
+   A deadline queue (MXP_QUEUE_DEADLINE) keeps an expiry tick for every message
+   posted with a nonzero expire time. mxp_q_wait drops expired messages and puts
+   them to the reclaim ring of the queue, the producer takes them back from there
+   with MXP_QUEUE_RECLAIM to release them.
+   A queue created with a high watermark posts ev_hiwat to the producer task
+   ptid when msgcnt reaches it and ev_lowat when msgcnt falls back to the low
+   watermark, so the producer can throttle before posts start to fail.
 
 */
-static MSG_CONTAINER_T     msgs[MAX_MASSAGES]; 
-static MSG_CONTAINER_T     *freeHead;
-static MSG_CONTAINER_T     *freeTail;
 static MSG_QUEUE_T         mqueue[MAX_QUEUES];
+static MSG_QUEUE_COLD_T    mqueue_cold[MAX_QUEUES];
 
-/* message list management *************************************************************/
-/* Insert container to the list head                                                   */
-/*
-static void q_putFirst(MSG_CONTAINER_T **head, MSG_CONTAINER_T **tail, MSG_CONTAINER_T *this)
+/* queue name index */
+static MXP_NAME_IDX_T      q_names;
+static short               q_names_next[MAX_QUEUES];
+
+/* queue ID allocator */
+static MXP_ID_ALLOC_T      q_ids;
+static DECLARE_BITMAP(q_ids_map, MAX_QUEUES);
+static short               q_ids_stack[MAX_QUEUES];
+
+/* q_table_lock guards the ID allocator, the name index and the state of every
+   queue going busy or free; each queue has its own lock for everything else */
+static DEFINE_SPINLOCK(q_table_lock);
+
+#define Q_LOCK(qid, fl)    spin_lock_irqsave(&(mqueue[qid].lock), fl)
+#define Q_UNLOCK(qid, fl)  spin_unlock_irqrestore(&(mqueue[qid].lock), fl)
+
+/* lock queue qid, returns 0 (and leaves it unlocked) if there is no such queue */
+static inline int q_lock(int qid, unsigned long *fl)
 {
-  MSG_CONTAINER_T *tmp;
+  if ((qid <= 0) || (qid >= MAX_QUEUES))
+    return 0;
+
+  Q_LOCK(qid, *fl);
+  if (mqueue[qid].state)
+    return 1;
+
+  Q_UNLOCK(qid, *fl);
+  return 0;
+}
+
+/* reclaim ring management *************************************************************/
+/* The helpers below only move the ring indexes and return the index of the entry  */
+/* used, the caller fills/reads msg[] at that index.                                */
+/* Reserve an entry at the ring tail                                                   */
+static inline int q_ringPut(MSG_RING_T *r, int size)
+{
+  int i = r->head + r->cnt;
+
+  if (i >= size) i -= size;
+  r->cnt++;
+  return i;
+}
 
-  this->p  = NULL;
-  if (!(*head)){
-    this->n = NULL;
-    *head   = this;
-    *tail   = this;
-  } else {
-    tmp     = *head;
-    *head   = this;
-    this->n = tmp;
-    tmp->p  = this;
-  }
-}*/
 /****************************************************************************************/
-/* Insert container to the list tail                                                   */
-static void q_putLast(MSG_CONTAINER_T **head, MSG_CONTAINER_T **tail, MSG_CONTAINER_T *this)
+/* Remove the entry at the ring head                                                    */
+static inline int q_ringGet(MSG_RING_T *r, int size)
 {
-  MSG_CONTAINER_T *tmp;
+  int i = r->head;
+
+  if (++r->head == size) r->head = 0;
+  r->cnt--;
+  return i;
+}
 
-  this->n  = NULL;
-  if (!(*tail)){
-    this->p = NULL;
-    *head   = this;
-    *tail   = this;
+/* entry pool management ***************************************************************/
+/* The helpers below only move the list links and return the index of the entry     */
+/* used, the caller fills/reads msg[] and the other per entry arrays at that index.  */
+/* Take a free entry and link it at the tail of level lvl, or at its head if jam     */
+static inline int q_entPut(MSG_QUEUE_T *q, int lvl, int jam)
+{
+  MSG_LEVEL_T *l = &(q->lvl[lvl]);
+  int i = q->freeent;
+
+  q->freeent = q->next[i];
+  if (l->cnt == 0){
+    q->next[i] = -1;
+    l->head = l->tail = i;
+  } else if (jam){
+    q->next[i] = l->head;
+    l->head = i;
   } else {
-    tmp     = *tail;
-    *tail   = this;
-    this->p = tmp;
-    tmp->n  = this;
+    q->next[i] = -1;
+    q->next[l->tail] = i;
+    l->tail = i;
   }
+  l->cnt++;
+  return i;
 }
 
 /****************************************************************************************/
-/* delete container from the list                                                       */
-static void q_msgDelete(MSG_CONTAINER_T **head, MSG_CONTAINER_T **tail, MSG_CONTAINER_T *this)
+/* Unlink the head entry of level lvl and free it; it stays readable until the next */
+/* post, the queue is locked                                                          */
+static inline int q_entGet(MSG_QUEUE_T *q, int lvl)
+{
+  MSG_LEVEL_T *l = &(q->lvl[lvl]);
+  int i = l->head;
+
+  l->head = q->next[i];
+  l->cnt--;
+  q->next[i] = q->freeent;
+  q->freeent = i;
+  return i;
+}
+
+/* statistics ***************************************************************************/
+/* message time stamp, in units of 1024 ns */
+#define Q_STAMP()  ((unsigned long)(sched_clock() >> 10))
+
+static void q_statDelay(MXP_QSTATS_T *st, unsigned long delay)
+{
+  int b = fls(delay);
+
+  if (b >= MXP_QSTAT_HIST_LEN) b = MXP_QSTAT_HIST_LEN - 1;
+  st->delay_hist[b]++;
+  st->delay_sum += delay;
+  if (delay > st->delay_max) st->delay_max = delay;
+}
+
+/* message deadlines *********************************************************************/
+#define Q_EXPIRED(deadline) (((deadline) != 0) && ((long)(mxp_tick - (deadline)) >= 0))
+
+/* give an expired message back: a copy-mode slot is freed, a message pointer goes
+   to the reclaim ring the producer drains; the oldest one is lost if it is full */
+static void q_reclaim(int qid, void *data)
+{
+  MSG_QUEUE_T *q = &mqueue[qid];
+  MSG_RING_T  *r = &(mqueue_cold[qid].reclaim);
+
+  if (q->payload){
+    q->payload->freeslot[q->payload->nfree++] = (int)data;
+    return;
+  }
+
+  if (r->cnt == q->depth){
+    q_ringGet(r, q->depth);
+    q->stats.reclaim_lost++;
+  }
+  r->msg[q_ringPut(r, q->depth)] = data;
+}
+
+/* producer backpressure ****************************************************************/
+/* called with the queue locked after a message has left the queue: post the resume */
+/* event once the queue has drained to the low watermark                               */
+static void q_lowCheck(int qid)
 {
-  if (this->n) (this->n)->p = this->p;
-  else         *tail        = this->p;
+  MSG_QUEUE_T *q = &mqueue[qid];
 
-  if (this->p) (this->p)->n = this->n;
-  else         *head        = this->n;
+  if (q->throttled && (q->msgcnt <= q->lowat)){
+    q->throttled = 0;
+    mxp_ev_post_by_tid(mqueue_cold[qid].ptid, mqueue_cold[qid].ev_lowat);
+  }
+}
+
+/* payload store management ************************************************************/
+#define Q_SLOT(p, slot)  ((p)->data + (slot) * (p)->msgsize)
+
+static MXP_QPAYLOAD_T *q_payloadAlloc(int depth, int msgsize)
+{
+  MXP_QPAYLOAD_T *p;
+  size_t slot = sizeof(int) + sizeof(int) + msgsize;
+  int j;
+
+  /* depth may include the spare slot of a conflating queue */
+  if ((depth <= 0) || (depth > MXP_QUEUE_MAX_DEPTH + 1) ||
+      ((size_t)depth > (((size_t)-1) - sizeof(MXP_QPAYLOAD_T)) / slot))
+    return NULL;
+
+  p = vmalloc(sizeof(MXP_QPAYLOAD_T) + depth * slot);
+  if (!p)
+    return NULL;
+
+  p->refs     = 1; /* the queue reference */
+  p->msgsize  = msgsize;
+  p->nfree    = depth;
+  p->freeslot = (int*)(p + 1);
+  p->len      = p->freeslot + depth;
+  p->data     = (unsigned char*)(p->len + depth);
+  for (j = 0; j < depth; j++)
+    p->freeslot[j] = j;
+
+  return p;
+}
+
+/* must be called with the queue locked; returns nonzero if p has to be freed */
+static int q_payloadUnref(MXP_QPAYLOAD_T *p)
+{
+  return (--p->refs == 0);
 }
 
 /*********************************************************************************
 * FUNCTION: q_Init
 *
-* DESCRIPTION: Initialize the list of free containers, and queue pull
+* DESCRIPTION: Initialize the queue pull
 *********************************************************************************/
 void q_Init(void)
 {
   int j;
 
-  freeHead = NULL;
-  freeTail = NULL;
-  for (j = 0; j < MAX_MASSAGES; j++)
-    q_putLast(&freeHead, &freeTail, &msgs[j]);
-
   memset(mqueue, 0, sizeof(mqueue));
   mqueue[0].state = 1; /* we don't use queue #0 */
+  memset(mqueue_cold, 0, sizeof(mqueue_cold));
+  nidx_Init(&q_names, q_names_next, mqueue_cold, sizeof(MSG_QUEUE_COLD_T),
+            offsetof(MSG_QUEUE_COLD_T, name), MAX_QUEUES);
+  idalloc_Init(&q_ids, q_ids_map, q_ids_stack, MAX_QUEUES, 1);
   for(j=1; j<MAX_QUEUES; j++){
     init_waitqueue_head(&(mqueue[j].queue_lock));
+    spin_lock_init(&(mqueue[j].lock));
   }
 }
 
@@ -109,13 +256,13 @@ void q_Init(void)
 static int msg_queue_alloc(void)
 {
     int j;
-    for (j = 1; j < MAX_QUEUES; j++){
-        if (!(mqueue[j].state)){
-            mqueue[j].state = 1;
-            return j;
-        }
-    }
-    return 0;
+
+    if ((j = idalloc_Get(&q_ids)) < 0)
+        return 0;
+
+    spin_lock(&(mqueue[j].lock));
+    mqueue[j].state = 1;
+    return j;
 }
 
 /*********************************************************************************
@@ -125,12 +272,7 @@ static int msg_queue_alloc(void)
 *********************************************************************************/
 static int qcb_by_name(char *name){
 
-  int j;
-  for (j = 1; j < MAX_QUEUES; j++)
-    if ((mqueue[j].state != 0) && (!strcmp(mqueue[j].name, name)))
-      return j;
-
-  return -1; /* name not found */
+  return nidx_Find(&q_names, name); /* -1 if name not found */
 }
 
 /*********************************************************************************
@@ -142,33 +284,141 @@ static int mxp_q_create(MXP_CMD_T*  msg)
 {
   unsigned long irq_st;
   int qid;
+  int levels = msg->cp.q.levels;
+  int lvl, i;
+  int entsize;
+  int depth = msg->cp.q.depth;
+  unsigned char *cursor;
+  void *store = NULL;
+  void **msgs = NULL, **reclaim = NULL;
+  unsigned long *stamps = NULL, *deadlines = NULL;
+  int *next = NULL, *keys = NULL;
+  MXP_QPAYLOAD_T *payload = NULL;
+
+  /* zero is accepted for callers that don't know about priority levels */
+  if (levels == 0)
+    levels = 1;
+  if ((levels < 0) || (levels > MXP_QUEUE_MAX_LEVELS))
+    return ERR_PRIINV;
+
+  if ((msg->cp.q.msgsize < 0) || (msg->cp.q.msgsize > MXP_QUEUE_MAX_PAYLOAD))
+    return ERR_INVBLK;
+
+  if (msg->cp.q.hiwat){
+    if ((msg->cp.q.hiwat < 0) || (msg->cp.q.hiwat > msg->cp.q.depth) ||
+        (msg->cp.q.lowat < 0) || (msg->cp.q.lowat >= msg->cp.q.hiwat))
+      return SYS_ILLEGAL_REQUEST;
+    if ((msg->cp.q.ptid <= 0) || (msg->cp.q.ptid >= MXP_TASK_MAX))
+      return ERR_TIDINV;
+  }
+
+  /* allocate the entry pool (and the payload store of a copy-mode queue)
+     before going atomic; a queue of zero depth is always full and needs no
+     storage. Entries of a conflating queue also keep the message key, entries
+     of a deadline queue keep the expiry tick and the queue gets a reclaim ring.
+     The arrays are laid out widest first to keep them aligned. */
+  entsize = sizeof(void*) + sizeof(unsigned long) + sizeof(int);
+  if (msg->cp.q.flags & MXP_QUEUE_CONFLATE)
+    entsize += sizeof(int);
+  if (msg->cp.q.flags & MXP_QUEUE_DEADLINE)
+    entsize += sizeof(unsigned long) + sizeof(void*);
+
+  if (depth > MXP_QUEUE_MAX_DEPTH)
+    return ERR_NOMEM;
+
+  if (depth > 0){
+    if ((size_t)depth > ((size_t)-1) / entsize)
+      return ERR_NOMEM;
+    store = vmalloc((size_t)entsize * depth);
+    if (!store)
+      return ERR_NOMEM;
+
+    cursor = (unsigned char*)store;
+    msgs   = (void**)cursor;          cursor += sizeof(void*) * depth;
+    stamps = (unsigned long*)cursor;  cursor += sizeof(unsigned long) * depth;
+    if (msg->cp.q.flags & MXP_QUEUE_DEADLINE){
+      deadlines = (unsigned long*)cursor;  cursor += sizeof(unsigned long) * depth;
+      reclaim   = (void**)cursor;          cursor += sizeof(void*) * depth;
+    }
+    next = (int*)cursor;              cursor += sizeof(int) * depth;
+    if (msg->cp.q.flags & MXP_QUEUE_CONFLATE)
+      keys = (int*)cursor;
+
+    /* all entries start on the free list */
+    for (i = 0; i < depth; i++)
+      next[i] = i + 1;
+    next[depth - 1] = -1;
+  }
 
-  local_irq_save(irq_st);
+  if (msg->cp.q.msgsize > 0){
+    if (msg->cp.q.depth <= 0)
+      return ERR_NOMEM;
+    /* a conflating queue needs a spare slot to replace a message when full */
+    if ((payload = q_payloadAlloc(msg->cp.q.depth +
+                   ((msg->cp.q.flags & MXP_QUEUE_CONFLATE) ? 1 : 0), msg->cp.q.msgsize)) == NULL){
+      vfree(store);
+      return ERR_NOMEM;
+    }
+  }
+
+  spin_lock_irqsave(&q_table_lock, irq_st);
 
   /* check whether the named queue already exists */
   if ( qcb_by_name(msg->cp.q.name) > 0 ){
-    local_irq_restore(irq_st);
+    spin_unlock_irqrestore(&q_table_lock, irq_st);
+    vfree(store);
+    if (payload) vfree(payload);
     return ERR_ASGN;
   }
 
-  /* try to allocate qcb */
+  /* try to allocate qcb, it is not usable before the queue lock is dropped */
   if ((qid = msg_queue_alloc()) == 0){
-    local_irq_restore(irq_st);
+    spin_unlock_irqrestore(&q_table_lock, irq_st);
+    vfree(store);
+    if (payload) vfree(payload);
     return ERR_NOQCB;
   }
 
-  strcpy(mqueue[qid].name,   msg->cp.q.name);
+  strcpy(mqueue_cold[qid].name,   msg->cp.q.name);
+  nidx_Insert(&q_names, qid);
   mqueue[qid].msgcnt   = 0;
   mqueue[qid].depth    = msg->cp.q.depth;
   mqueue[qid].taskId   = msg->cp.q.tid;
   mqueue[qid].events   = msg->cp.q.events;
-  mqueue[qid].head     = NULL;
-  mqueue[qid].tail     = NULL;
+  mqueue[qid].levels   = levels;
+  mqueue[qid].lvlmask  = 0;
+  mqueue_cold[qid].store    = store;
+  mqueue[qid].msg      = msgs;
+  mqueue[qid].stamp    = stamps;
+  mqueue[qid].key      = keys;
+  mqueue[qid].deadline = deadlines;
+  mqueue[qid].next     = next;
+  mqueue[qid].freeent  = (depth > 0) ? 0 : -1;
+  for (lvl = 0; lvl < MXP_QUEUE_MAX_LEVELS; lvl++){
+    mqueue[qid].lvl[lvl].head = -1;
+    mqueue[qid].lvl[lvl].tail = -1;
+    mqueue[qid].lvl[lvl].cnt  = 0;
+  }
+  memset(&(mqueue_cold[qid].reclaim), 0, sizeof(mqueue_cold[qid].reclaim));
+  mqueue_cold[qid].reclaim.msg = reclaim;
+  mqueue[qid].flags    = msg->cp.q.flags & (MXP_QUEUE_CONFLATE | MXP_QUEUE_DEADLINE);
+  memset(&(mqueue[qid].stats), 0, sizeof(mqueue[qid].stats));
+  mqueue[qid].stats.since = mxp_tick;
+  mqueue[qid].hiwat    = msg->cp.q.hiwat;
+  mqueue[qid].lowat    = msg->cp.q.lowat;
+  mqueue_cold[qid].ptid     = msg->cp.q.ptid;
+  mqueue_cold[qid].ev_hiwat = msg->cp.q.ev_hiwat;
+  mqueue_cold[qid].ev_lowat = msg->cp.q.ev_lowat;
+  mqueue[qid].throttled = 0;
+  mqueue[qid].payload  = payload;
   mqueue[qid].wait4msg = 0;
+  mqueue[qid].ringwait      = 0;
+  mqueue[qid].ringwait_tail = 0;
 
   msg->cp.q.qid = qid;
 
-  local_irq_restore(irq_st);
+  spin_unlock(&(mqueue[qid].lock));
+  spin_unlock_irqrestore(&q_table_lock, irq_st);
   return ERR_NOERR;
 }
 
@@ -180,25 +430,53 @@ static int mxp_q_create(MXP_CMD_T*  msg)
 static int mxp_q_delete(MXP_CMD_T*  msg)
 {
   unsigned long irq_st;
-  MSG_CONTAINER_T *cont;
+  MXP_QPAYLOAD_T *payload;
+  void *store;
   int qid = msg->cp.q.qid;
+  int release = 0;
+  int wakeup_q;
 
-  local_irq_save(irq_st);
-  if ((qid <= 0) || (qid >= MAX_QUEUES) || (mqueue[qid].state == 0)){
-    local_irq_restore(irq_st);
+  if ((qid <= 0) || (qid >= MAX_QUEUES))
+    return ERR_QIDINV;
+
+  spin_lock_irqsave(&q_table_lock, irq_st);
+  spin_lock(&(mqueue[qid].lock));
+  if (mqueue[qid].state == 0){
+    spin_unlock(&(mqueue[qid].lock));
+    spin_unlock_irqrestore(&q_table_lock, irq_st);
     return ERR_QIDINV;
   }
 
-  /* remove all messages from the queue */
-  while (mqueue[qid].head != NULL){
-    cont = mqueue[qid].head;
-    q_msgDelete( &(mqueue[qid].head), &(mqueue[qid].tail), cont);
-    q_putLast(&freeHead, &freeTail, cont);
+  /* release the message storage */
+  store = mqueue_cold[qid].store;
+  mqueue_cold[qid].store   = NULL;
+  mqueue[qid].msgcnt  = 0;
+  mqueue[qid].lvlmask = 0;
+
+  /* drop the queue reference to the payload store */
+  if ((payload = mqueue[qid].payload) != NULL){
+    mqueue[qid].payload = NULL;
+    release = q_payloadUnref(payload);
   }
 
+  /* the submission ring waits linked on the queue fail */
+  while (mqueue[qid].ringwait)
+    ring_qComplete(qid, ERR_QUNASGN, 0, NULL);
+
+  nidx_Remove(&q_names, qid);
   mqueue[qid].state = 0;
+  idalloc_Put(&q_ids, qid);
+  wakeup_q = mqueue[qid].wait4msg || mqueue[qid].waitany;
+  mqueue[qid].wait4msg = 0;
 
-  local_irq_restore(irq_st);
+  spin_unlock(&(mqueue[qid].lock));
+  spin_unlock_irqrestore(&q_table_lock, irq_st);
+  /* a blocked waiter returns ERR_QUNASGN, a MXP_QUEUE_WAIT_ANY one ERR_QIDINV */
+  if (wakeup_q)
+    wake_up(&(mqueue[qid].queue_lock));
+  vfree(store);
+  if (release)
+    vfree(payload);
   return ERR_NOERR;
 }
 
@@ -221,58 +499,324 @@ static int mxp_q_delete_all(void)
   return ERR_NOERR;
 }
 
+/* where the payload of a copy-mode queue post comes from */
+#define Q_SRC_USER   0  /* msg_ptr is a user buffer of msgsize bytes   */
+#define Q_SRC_KERNEL 1  /* msg_ptr is a kernel buffer of msgsize bytes */
+#define Q_SRC_VALUE  2  /* the msg_ptr value itself is the payload     */
+
 /*********************************************************************************
-* FUNCTION: mxp_q_post
+* FUNCTION: q_findKey
 *
-* DESCRIPTION:
+* DESCRIPTION: find the pending message with the given key in a conflating queue,
+*              returns the entry index or -1 if not found
 *********************************************************************************/
-static int mxp_q_post(MXP_CMD_T*  msg)
+static int q_findKey(MSG_QUEUE_T *q, int key)
+{
+  int lvl, k, i;
+
+  for (lvl = 0; lvl < q->levels; lvl++)
+    for (k = 0, i = q->lvl[lvl].head; k < q->lvl[lvl].cnt; k++, i = q->next[i])
+      if (q->key[i] == key)
+        return i;
+  return -1;
+}
+
+/* serve the submission ring waits linked on queue qid with its queued messages,
+   highest level first. Tasks sleeping in mxp_q_wait or mxp_q_wait_any were
+   there before (a ring wait is linked on an empty queue only), so nothing is
+   served while there are any. The queue is locked. */
+static void q_ringServe(int qid)
+{
+  MSG_QUEUE_T *q = &mqueue[qid];
+  int lvl, i;
+
+  while (q->ringwait && q->msgcnt && !q->wait4msg && !q->waitany){
+    lvl = fls(q->lvlmask) - 1;
+    i   = q_entGet(q, lvl);
+    if (q->lvl[lvl].cnt == 0)
+      q->lvlmask &= ~(1 << lvl);
+    q->msgcnt--;
+    q_lowCheck(qid);
+
+    if (q->deadline && Q_EXPIRED(q->deadline[i])){
+      q->stats.expired++;
+      q_reclaim(qid, q->msg[i]);
+      continue;
+    }
+
+    q->stats.waits++;
+    q_statDelay(&(q->stats), Q_STAMP() - q->stamp[i]);
+    ring_qComplete(qid, ERR_NOERR, lvl, q->msg[i]);
+  }
+}
+
+/* MXP_QPOST_SWITCH: hand the CPU over to task tid that was just woken up, if it
+   runs at our priority or above. Must not be called in atomic context. */
+static void q_switchTo(int tid)
+{
+  struct task_struct *p;
+
+  if (in_interrupt() || ((p = tcb_task(tid)) == NULL))
+    return;
+
+  if ((p == current) || (p->prio > current->prio)){
+    put_task_struct(p);
+    return;
+  }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
+  yield_to(p, 1);
+#else
+  /* no directed yield: give up the CPU and let the scheduler pick the receiver */
+  yield();
+#endif
+  put_task_struct(p);
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_q_post_ex
+*
+* DESCRIPTION: post a message. In a conflating queue a message whose key is
+*              already pending replaces that message in place; the replaced
+*              message pointer is returned in msg_ptr (NULL if nothing was
+*              replaced) so the poster can release it.
+*********************************************************************************/
+static int mxp_q_post_ex(MXP_CMD_T*  msg, int src)
 {
   unsigned long irq_st;
-  MSG_CONTAINER_T *cont;
+  MXP_QPAYLOAD_T  *payload;
   int qid = msg->cp.q.qid;
+  int lvl = msg->cp.q.prio;
   int wakeup_q = 0;
   int wakeup_t = 0;
+  int throttle_t = 0;
+  int switch_t = 0;
+  int slot, len, err, i;
+  void *data;
   MXP_CMD_T  msg_ev;
 
-  local_irq_save(irq_st);
-  if ((qid <= 0) || (qid >= MAX_QUEUES) || (mqueue[qid].state == 0)){
-    local_irq_restore(irq_st);
+  if (!q_lock(qid, &irq_st))
     return ERR_QIDINV;
+
+  if ((lvl < 0) || (lvl >= mqueue[qid].levels)){
+    Q_UNLOCK(qid, irq_st);
+    return ERR_PRIINV;
+  }
+
+  if (msg->cp.q.expire && !(mqueue[qid].flags & MXP_QUEUE_DEADLINE)){
+    Q_UNLOCK(qid, irq_st);
+    return SYS_ILLEGAL_REQUEST;
   }
 
-  if (mqueue[qid].msgcnt >= mqueue[qid].depth){
-    local_irq_restore(irq_st);
+  /* a conflating queue may take the post even when full, checked below */
+  if (!(mqueue[qid].flags & MXP_QUEUE_CONFLATE) &&
+      (mqueue[qid].msgcnt >= mqueue[qid].depth)){
+    mqueue[qid].stats.drops++;
+    Q_UNLOCK(qid, irq_st);
     return ERR_QFULL;
   }
-  /* prepare the message */
-  cont = freeHead;
-  q_msgDelete(&freeHead, &freeTail, cont);
-  cont->msg = msg->cp.q.msg_ptr;
-  q_putLast( &(mqueue[qid].head), &(mqueue[qid].tail), cont);
+
+  slot = -1;
+  if ((payload = mqueue[qid].payload) != NULL){
+    /* copy-mode queue: reserve a slot and copy the payload into it */
+    len = (src == Q_SRC_VALUE) ? sizeof(void*) : msg->cp.q.msgsize;
+    if ((len < 0) || (len > payload->msgsize)){
+      Q_UNLOCK(qid, irq_st);
+      return ERR_INVBLK;
+    }
+    if (payload->nfree == 0){
+      mqueue[qid].stats.drops++;
+      Q_UNLOCK(qid, irq_st);
+      return ERR_QFULL;
+    }
+    slot = payload->freeslot[--payload->nfree];
+    payload->len[slot] = len;
+
+    if (src == Q_SRC_USER){
+      payload->refs++;
+      Q_UNLOCK(qid, irq_st);
+      err = copy_from_user(Q_SLOT(payload, slot), (void __user *)msg->cp.q.msg_ptr, len);
+      Q_LOCK(qid, irq_st);
+
+      if (err || (mqueue[qid].payload != payload)){
+        /* bad user buffer, or the queue was deleted while we were copying */
+        if (mqueue[qid].payload == payload)
+          payload->freeslot[payload->nfree++] = slot;
+        if (q_payloadUnref(payload)){
+          Q_UNLOCK(qid, irq_st);
+          vfree(payload);
+        } else
+          Q_UNLOCK(qid, irq_st);
+        return err ? ERR_NULLPTR : ERR_QUNASGN;
+      }
+      q_payloadUnref(payload); /* the queue still holds its reference */
+    } else if (src == Q_SRC_KERNEL){
+      memcpy(Q_SLOT(payload, slot), msg->cp.q.msg_ptr, len);
+    } else {
+      memcpy(Q_SLOT(payload, slot), &msg->cp.q.msg_ptr, len);
+    }
+    data = (void*)slot;
+  } else {
+    data = msg->cp.q.msg_ptr;
+  }
+
+  if (mqueue[qid].flags & MXP_QUEUE_CONFLATE){
+    msg->cp.q.msg_ptr = NULL;
+    if ((i = q_findKey(&mqueue[qid], msg->cp.q.key)) >= 0){
+      /* replace the pending message in place, it keeps its position and
+         time stamp; the waiter (if any) was already woken up for it */
+      if (payload)
+        payload->freeslot[payload->nfree++] = (int)mqueue[qid].msg[i];
+      else
+        msg->cp.q.msg_ptr = mqueue[qid].msg[i];
+      mqueue[qid].msg[i] = data;
+      if (mqueue[qid].deadline)
+        mqueue[qid].deadline[i] = msg->cp.q.expire ? (mxp_tick + msg->cp.q.expire) : 0;
+      mqueue[qid].stats.conflated++;
+      Q_UNLOCK(qid, irq_st);
+      return ERR_NOERR;
+    }
+
+    if (mqueue[qid].msgcnt >= mqueue[qid].depth){
+      if (payload)
+        payload->freeslot[payload->nfree++] = slot;
+      mqueue[qid].stats.drops++;
+      Q_UNLOCK(qid, irq_st);
+      return ERR_QFULL;
+    }
+  }
+
+  /* put the message to its level */
+  i = q_entPut(&mqueue[qid], lvl, msg->cp.q.flags & MXP_QPOST_JAM);
+  mqueue[qid].msg[i]   = data;
+  mqueue[qid].stamp[i] = Q_STAMP();
+  if (mqueue[qid].key)
+    mqueue[qid].key[i] = msg->cp.q.key;
+  if (mqueue[qid].deadline)
+    mqueue[qid].deadline[i] = msg->cp.q.expire ? (mxp_tick + msg->cp.q.expire) : 0;
+  mqueue[qid].lvlmask |= (1 << lvl);
   mqueue[qid].msgcnt++;
 
+  mqueue[qid].stats.posts++;
+  if (mqueue[qid].msgcnt > mqueue[qid].stats.hwm)
+    mqueue[qid].stats.hwm = mqueue[qid].msgcnt;
+
+  /* submission ring waits take it if no task sleeps on the queue */
+  q_ringServe(qid);
+
+  /* the consumer falls behind, tell the producer to throttle */
+  if (mqueue[qid].hiwat && !mqueue[qid].throttled &&
+      (mqueue[qid].msgcnt >= mqueue[qid].hiwat)){
+    mqueue[qid].throttled = 1;
+    mqueue[qid].stats.throttles++;
+    throttle_t = mqueue_cold[qid].ptid;
+  }
+
   if (mqueue[qid].wait4msg > 0){
     mqueue[qid].wait4msg = 0;
     wakeup_q = 1;
   }
+  if (mqueue[qid].waitany > 0)
+    wakeup_q = 1;
 
   if (mqueue[qid].taskId != 0){
     wakeup_t = mqueue[qid].taskId;
     msg_ev.cp.ev.tid    = wakeup_t;
     msg_ev.cp.ev.events = mqueue[qid].events;
+    /* switch only if the owner was blocked on the queue or its events */
+    if ((msg->cp.q.flags & MXP_QPOST_SWITCH) &&
+        (wakeup_t > 0) && (wakeup_t < MXP_TASK_MAX) &&
+        (wakeup_q || mxp_tcb[wakeup_t].wait4event))
+      switch_t = wakeup_t;
   }
 
-  local_irq_restore(irq_st);
+  Q_UNLOCK(qid, irq_st);
   if (wakeup_q)
     wake_up(&(mqueue[qid].queue_lock));
 
-  if (wakeup_t)
-    return mxp_ev_post(&msg_ev);
+  if (throttle_t)
+    mxp_ev_post_by_tid(throttle_t, mqueue_cold[qid].ev_hiwat);
+
+  if (wakeup_t){
+    err = mxp_ev_post(&msg_ev);
+    if (switch_t && (err == ERR_NOERR))
+      q_switchTo(switch_t);
+    return err;
+  }
 
   return ERR_NOERR;
 }
 
+/* the queue fields an original MXP_CMD_V1_T code does not pass, past the end of
+   what was copied in (or in its padding) */
+static inline void q_v1Defaults(MXP_CMD_T*  msg)
+{
+  msg->cp.q.levels   = 0;
+  msg->cp.q.prio     = 0;
+  msg->cp.q.flags    = 0;
+  msg->cp.q.key      = 0;
+  msg->cp.q.expire   = 0;
+  msg->cp.q.msgsize  = 0;
+  msg->cp.q.hiwat    = 0;
+  msg->cp.q.lowat    = 0;
+  msg->cp.q.ptid     = 0;
+  msg->cp.q.ev_hiwat = 0;
+  msg->cp.q.ev_lowat = 0;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_q_post
+*
+* DESCRIPTION: post from user space
+*********************************************************************************/
+static int mxp_q_post(MXP_CMD_T*  msg)
+{
+  return mxp_q_post_ex(msg, Q_SRC_USER);
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_q_post_by_qid
+*
+* DESCRIPTION: post from another kernel driver, callable from softirq context.
+*              For a copy-mode queue msg is a kernel buffer of msgsize bytes that
+*              is copied into the queue, otherwise msg itself is queued and
+*              msgsize is ignored. prio is the queue level (0 - lowest).
+*              A message replaced in a conflating pointer queue is not returned.
+*********************************************************************************/
+int mxp_q_post_by_qid(int qid, void *msg, int msgsize, int prio)
+{
+  MXP_CMD_T   cmd;
+
+  cmd.cp.q.qid      = qid;
+  cmd.cp.q.msg_ptr  = msg;
+  cmd.cp.q.msgsize  = msgsize;
+  cmd.cp.q.prio     = prio;
+  cmd.cp.q.flags    = 0;
+  cmd.cp.q.key      = 0;
+  cmd.cp.q.expire   = 0;
+
+  return mxp_q_post_ex(&cmd, Q_SRC_KERNEL);
+}
+EXPORT_SYMBOL(mxp_q_post_by_qid);
+
+/*********************************************************************************
+* FUNCTION: mxp_q_id_by_name
+*
+* DESCRIPTION: find qid by name for another kernel driver, -1 if not found
+*********************************************************************************/
+int mxp_q_id_by_name(char *name)
+{
+  unsigned long irq_st;
+  int qid;
+
+  spin_lock_irqsave(&q_table_lock, irq_st);
+  qid = qcb_by_name(name);
+  spin_unlock_irqrestore(&q_table_lock, irq_st);
+
+  return qid;
+}
+EXPORT_SYMBOL(mxp_q_id_by_name);
+
 /*********************************************************************************
 * FUNCTION: mxp_q_wait
 *
@@ -281,58 +825,230 @@ static int mxp_q_post(MXP_CMD_T*  msg)
 static int mxp_q_wait(MXP_CMD_T*  msg)
 {
   unsigned long irq_st;
-  MSG_CONTAINER_T *cont;
+  MSG_QUEUE_T     *q;
+  MXP_QPAYLOAD_T  *payload;
+  void *data;
   int qid = msg->cp.q.qid;
+  int lvl, head;
+  int slot, err, i;
   int ret;
+  int spin_tid;
+  int spin_hit = 0;
+  unsigned int spin_t0 = 0;  /* nonzero once this wait has spun */
 
-  local_irq_save(irq_st);
-  if ((qid <= 0) || (qid >= MAX_QUEUES) || (mqueue[qid].state == 0)){
-    local_irq_restore(irq_st);
+  if (!q_lock(qid, &irq_st))
     return ERR_QIDINV;
-  }
+  q = &mqueue[qid];
+
+  /* only the queue owner spins, with its own window and counters; any other
+     task waiting on the queue goes straight to sleep */
+  spin_tid = mqueue[qid].taskId;
+  if ((spin_tid <= 0) || (spin_tid >= MXP_TASK_MAX) || !TCB_SPINS(spin_tid) ||
+      (mxp_subtcb[spin_tid].task != current))
+    spin_tid = 0;
 
   while(1){
     if (mqueue[qid].msgcnt){
-      /* we have a message in the queue */
-      cont = mqueue[qid].head;
-      q_msgDelete(&(mqueue[qid].head), &(mqueue[qid].tail), cont);
-      q_putLast(&freeHead, &freeTail, cont);
-      msg->cp.q.msg_ptr = cont->msg;
+      /* we have a message in the queue, take it from the highest level */
+      lvl     = fls(mqueue[qid].lvlmask) - 1;
+      head    = q->lvl[lvl].head;
+      payload = mqueue[qid].payload;
+
+      if (q->deadline && Q_EXPIRED(q->deadline[head])){
+        /* stale message: drop it and look at the next one */
+        i = q_entGet(q, lvl);
+        if (q->lvl[lvl].cnt == 0)
+          mqueue[qid].lvlmask &= ~(1 << lvl);
+        mqueue[qid].msgcnt--;
+        q_lowCheck(qid);
+        mqueue[qid].stats.expired++;
+        q_reclaim(qid, q->msg[i]);
+        continue;
+      }
+
+      /* a copy-mode message is left in the queue if the buffer is too small */
+      if (payload && (msg->cp.q.msgsize < payload->len[(int)q->msg[head]])){
+        msg->cp.q.msgsize = payload->len[(int)q->msg[head]];
+        Q_UNLOCK(qid, irq_st);
+        return ERR_NOMEM;
+      }
+
+      if (spin_t0){
+        tcb_spinDone(spin_tid, spin_t0, spin_hit);
+        spin_t0 = 0;
+      }
+      i    = q_entGet(q, lvl);
+      data = q->msg[i];
+      mqueue[qid].stats.waits++;
+      q_statDelay(&(mqueue[qid].stats), Q_STAMP() - q->stamp[i]);
+      msg->cp.q.prio    = lvl;
+      if (q->lvl[lvl].cnt == 0)
+        mqueue[qid].lvlmask &= ~(1 << lvl);
       mqueue[qid].msgcnt--;
-      local_irq_restore(irq_st);
-      return ERR_NOERR;
+      q_lowCheck(qid);
+
+      if (payload == NULL){
+        msg->cp.q.msg_ptr = data;
+        Q_UNLOCK(qid, irq_st);
+        return ERR_NOERR;
+      }
+
+      /* copy the payload out, the slot stays reserved until it is done */
+      slot = (int)data;
+      msg->cp.q.msgsize = payload->len[slot];
+      payload->refs++;
+      Q_UNLOCK(qid, irq_st);
+      err = copy_to_user((void __user *)msg->cp.q.msg_ptr, Q_SLOT(payload, slot), payload->len[slot]);
+      Q_LOCK(qid, irq_st);
+      if (mqueue[qid].payload == payload)
+        payload->freeslot[payload->nfree++] = slot;
+      if (q_payloadUnref(payload)){
+        Q_UNLOCK(qid, irq_st);
+        vfree(payload);
+      } else
+        Q_UNLOCK(qid, irq_st);
+      return err ? ERR_NULLPTR : ERR_NOERR;
     }
 
     if (msg->cp.q.timeout == MX_NO_BLOCK){
-      local_irq_restore(irq_st);
+      Q_UNLOCK(qid, irq_st);
       return ERR_QEMPTY;
     }
 
+    /* spin a while before we go to sleep, once per wait */
+    if (spin_tid && !spin_t0){
+      spin_t0 = SPIN_STAMP() | 1;
+      Q_UNLOCK(qid, irq_st);
+      spin_hit = tcb_spin(spin_tid, mqueue[qid].msgcnt != 0);
+      if (!q_lock(qid, &irq_st))
+        return ERR_QUNASGN;
+      if (spin_hit)
+        continue;
+    }
+
     /* if timeout is not MX_NO_BLOCK, consider it as MX_INDEFINITE */
     mqueue[qid].wait4msg = 1; /* flag that we wait a message */
-    local_irq_restore(irq_st);
+    Q_UNLOCK(qid, irq_st);
     ret = wait_event_interruptible( (mqueue[qid].queue_lock), mqueue[qid].wait4msg == 0);
-    local_irq_save(irq_st);
+    Q_LOCK(qid, irq_st);
 
     /* after waking up we have to decide whether it was caused by post message or
       other unexpected signal */
     if ( ret == -ERESTARTSYS ){
       /* it was unexpected signal */
       mqueue[qid].wait4msg       = 0;
-      local_irq_restore(irq_st);
+      Q_UNLOCK(qid, irq_st);
       printk( KERN_INFO "mxp_q_wait for queueId %d waken up by unexpected signal\n", qid);
       return SYS_CONFIG_ERR;
     }
 
-    /* here we must have a message; if we don't somebody tool it */
-    if (mqueue[qid].msgcnt == 0){
-      local_irq_restore(irq_st);
-      printk( KERN_INFO "mxp_q_wait for queueId %d found no message\n", qid);
-      return SYS_CONFIG_ERR;
+    if (mqueue[qid].state == 0){
+      Q_UNLOCK(qid, irq_st);
+      return ERR_QUNASGN;
     }
+
+    /* another waiter may have taken the message first, then we just wait
+       again */
   }
 }
 
+/*********************************************************************************
+* FUNCTION: mxp_q_wait_any
+*
+* DESCRIPTION: wait for a message on any queue of the set. The queues are checked
+*              in the given order when MXP_QWAIT_ORDERED is set, otherwise the
+*              check starts after the queue served last time (qid on input) so
+*              a busy queue can't starve the others. The caller is queued on the
+*              wait queue of every queue of the set and sleeps only once.
+*********************************************************************************/
+static int mxp_q_wait_any(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  MXP_CMD_T sub;
+  wait_queue_t wait[MXP_QUEUE_WAITANY_MAX];
+  int n = msg->cp.qany.nqids;
+  int first = 0;
+  int j, k, qid, ret;
+
+  if ((n <= 0) || (n > MXP_QUEUE_WAITANY_MAX))
+    return ERR_QIDINV;
+
+  for (j = 0; j < n; j++){
+    qid = msg->cp.qany.qids[j];
+    if (!q_lock(qid, &irq_st))
+      return ERR_QIDINV;
+    Q_UNLOCK(qid, irq_st);
+    if (!(msg->cp.qany.flags & MXP_QWAIT_ORDERED) && (qid == msg->cp.qany.qid))
+      first = (j + 1) % n;
+  }
+
+  for (j = 0; j < n; j++)
+    init_waitqueue_entry(&wait[j], current);
+
+  ret = ERR_QEMPTY;
+  k   = -1;
+  while (1){
+    /* try to take a message, one queue after another */
+    for (j = 0; j < n; j++){
+      sub.cp.q.qid     = msg->cp.qany.qids[(first + j) % n];
+      sub.cp.q.timeout = MX_NO_BLOCK;
+      sub.cp.q.msg_ptr = msg->cp.qany.msg_ptr;
+      sub.cp.q.msgsize = msg->cp.qany.msgsize;
+      if ((ret = mxp_q_wait(&sub)) != ERR_QEMPTY)
+        break;
+    }
+
+    if ((ret != ERR_QEMPTY) || (msg->cp.qany.timeout == MX_NO_BLOCK))
+      break;
+
+    /* if timeout is not MX_NO_BLOCK, consider it as MX_INDEFINITE */
+    if (k < 0){
+      for (k = 0; k < n; k++){
+        qid = msg->cp.qany.qids[k];
+        Q_LOCK(qid, irq_st);
+        mqueue[qid].waitany++;
+        Q_UNLOCK(qid, irq_st);
+        add_wait_queue(&(mqueue[qid].queue_lock), &wait[k]);
+      }
+    }
+
+    /* a post after this check sees waitany and wakes us, schedule returns at once */
+    set_current_state(TASK_INTERRUPTIBLE);
+    for (j = 0; j < n; j++)
+      if (mqueue[msg->cp.qany.qids[j]].msgcnt)
+        break;
+
+    if (j == n){
+      if (signal_pending(current)){
+        __set_current_state(TASK_RUNNING);
+        printk( KERN_INFO "mxp_q_wait_any waken up by unexpected signal\n");
+        ret = SYS_CONFIG_ERR;
+        break;
+      }
+      schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+  }
+
+  if (k >= 0){
+    for (k = 0; k < n; k++){
+      qid = msg->cp.qany.qids[k];
+      remove_wait_queue(&(mqueue[qid].queue_lock), &wait[k]);
+      Q_LOCK(qid, irq_st);
+      mqueue[qid].waitany--;
+      Q_UNLOCK(qid, irq_st);
+    }
+  }
+
+  if (ret == ERR_NOERR){
+    msg->cp.qany.qid     = sub.cp.q.qid;
+    msg->cp.qany.msg_ptr = sub.cp.q.msg_ptr;
+    msg->cp.qany.prio    = sub.cp.q.prio;
+  }
+  msg->cp.qany.msgsize = sub.cp.q.msgsize;
+  return ret;
+}
+
 /*********************************************************************************
 * FUNCTION: mxp_q_identify
 *
@@ -343,12 +1059,12 @@ static int mxp_q_identify(MXP_CMD_T*  msg)
   unsigned long irq_st;
   int ret = ERR_NOERR;
 
-  local_irq_save(irq_st);
+  spin_lock_irqsave(&q_table_lock, irq_st);
 
-  if ((msg->cp.q.qid = qcb_by_name(msg->cp.q.name)) == 0)
+  if ((msg->cp.q.qid = qcb_by_name(msg->cp.q.name)) == -1)
     ret = ERR_INVNAME;
 
-  local_irq_restore(irq_st);
+  spin_unlock_irqrestore(&q_table_lock, irq_st);
   return ret;
 }
 
@@ -362,15 +1078,169 @@ static int mxp_q_inquiry(MXP_CMD_T*  msg)
   unsigned long irq_st;
   int qid = msg->cp.q.qid;
 
-  local_irq_save(irq_st);
-  if ((qid <= 0) || (qid >= MAX_QUEUES) || (mqueue[qid].state == 0)){
-    local_irq_restore(irq_st);
+  if (!q_lock(qid, &irq_st))
     return ERR_QIDINV;
-  }
 
   msg->cp.q.depth = mqueue[qid].msgcnt;
 
-  local_irq_restore(irq_st);
+  Q_UNLOCK(qid, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_q_peek
+*
+* DESCRIPTION: return the message(s) at the head of the queue without removing
+*              them. The first message is always returned in msg_ptr; if a user
+*              buffer is given, up to count message pointers are copied into it
+*              in the order mxp_q_wait would deliver them.
+*********************************************************************************/
+static int mxp_q_peek(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  MSG_QUEUE_T *q;
+  void *ptrs[MXP_QUEUE_PEEK_MAX];
+  int qid = msg->cp.qpeek.qid;
+  int max = msg->cp.qpeek.count;
+  int cnt = 0;
+  int found = 0;
+  int lvl, k, i;
+
+  if ((max < 0) || (msg->cp.qpeek.msgs == NULL))
+    max = 0;
+  else if (max > MXP_QUEUE_PEEK_MAX)
+    max = MXP_QUEUE_PEEK_MAX;
+
+  if (!q_lock(qid, &irq_st))
+    return ERR_QIDINV;
+  q = &mqueue[qid];
+
+  /* copy-mode queues have no message pointers to show */
+  if (mqueue[qid].payload != NULL){
+    Q_UNLOCK(qid, irq_st);
+    return SYS_NO_SUPPORT;
+  }
+
+  /* expired messages are skipped, mxp_q_wait drops them on the way */
+  for (lvl = fls(mqueue[qid].lvlmask) - 1; (lvl >= 0) && (!found || (cnt < max)); lvl--){
+    for (k = 0, i = q->lvl[lvl].head; (k < q->lvl[lvl].cnt) && (!found || (cnt < max));
+         k++, i = q->next[i]){
+      if (q->deadline && Q_EXPIRED(q->deadline[i]))
+        continue;
+      if (!found){
+        msg->cp.qpeek.msg_ptr = q->msg[i];
+        found = 1;
+      }
+      if (cnt < max)
+        ptrs[cnt++] = q->msg[i];
+    }
+  }
+
+  Q_UNLOCK(qid, irq_st);
+
+  if (!found){
+    msg->cp.qpeek.count = 0;
+    return ERR_QEMPTY;
+  }
+
+  msg->cp.qpeek.count = cnt;
+  if (cnt && copy_to_user((void __user *)msg->cp.qpeek.msgs, ptrs, cnt * sizeof(void*)))
+    return ERR_NULLPTR;
+
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_q_reclaim
+*
+* DESCRIPTION: take up to count expired messages from the reclaim ring of the queue
+*********************************************************************************/
+static int mxp_q_reclaim(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  void *ptrs[MXP_QUEUE_PEEK_MAX];
+  int qid = msg->cp.qrcl.qid;
+  int max = msg->cp.qrcl.count;
+  int cnt = 0;
+
+  if (msg->cp.qrcl.msgs == NULL)
+    return ERR_NULLPTR;
+  if (max > MXP_QUEUE_PEEK_MAX)
+    max = MXP_QUEUE_PEEK_MAX;
+
+  if (!q_lock(qid, &irq_st))
+    return ERR_QIDINV;
+
+  if (!(mqueue[qid].flags & MXP_QUEUE_DEADLINE) || (mqueue[qid].payload != NULL)){
+    Q_UNLOCK(qid, irq_st);
+    return SYS_NO_SUPPORT;
+  }
+
+  while ((cnt < max) && mqueue_cold[qid].reclaim.cnt)
+    ptrs[cnt++] = mqueue_cold[qid].reclaim.msg[q_ringGet(&(mqueue_cold[qid].reclaim), mqueue[qid].depth)];
+
+  Q_UNLOCK(qid, irq_st);
+
+  msg->cp.qrcl.count = cnt;
+  if (cnt && copy_to_user((void __user *)msg->cp.qrcl.msgs, ptrs, cnt * sizeof(void*)))
+    return ERR_NULLPTR;
+
+  return (cnt ? ERR_NOERR : ERR_QEMPTY);
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_q_lvl_inquiry
+*
+* DESCRIPTION: get number of messages on every priority level
+*********************************************************************************/
+static int mxp_q_lvl_inquiry(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int qid = msg->cp.qlvl.qid;
+  int lvl;
+
+  if (!q_lock(qid, &irq_st))
+    return ERR_QIDINV;
+
+  msg->cp.qlvl.levels = mqueue[qid].levels;
+  for (lvl = 0; lvl < MXP_QUEUE_MAX_LEVELS; lvl++)
+    msg->cp.qlvl.msgcnt[lvl] = (lvl < mqueue[qid].levels) ? mqueue[qid].lvl[lvl].cnt : 0;
+
+  Q_UNLOCK(qid, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_q_stats
+*
+* DESCRIPTION: copy the queue statistics to the user buffer, optionally reset them
+*********************************************************************************/
+static int mxp_q_stats(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  MXP_QSTATS_T st;
+  int qid = msg->cp.qstats.qid;
+
+  if (!q_lock(qid, &irq_st))
+    return ERR_QIDINV;
+
+  st = mqueue[qid].stats;
+  st.now    = mxp_tick;
+  st.msgcnt = mqueue[qid].msgcnt;
+  st.depth  = mqueue[qid].depth;
+  st.throttled = mqueue[qid].throttled;
+
+  if (msg->cp.qstats.reset){
+    memset(&(mqueue[qid].stats), 0, sizeof(mqueue[qid].stats));
+    mqueue[qid].stats.since = mxp_tick;
+    mqueue[qid].stats.hwm   = mqueue[qid].msgcnt;
+  }
+  Q_UNLOCK(qid, irq_st);
+
+  if ((msg->cp.qstats.stats != NULL) &&
+      copy_to_user((void __user *)msg->cp.qstats.stats, &st, sizeof(st)))
+    return ERR_NULLPTR;
+
   return ERR_NOERR;
 }
 
@@ -384,12 +1254,30 @@ static int mxp_queue_proc(char *buf, char **start, off_t offset,
 {
   int len = 0;
   int j;
+  unsigned long secs;
+  unsigned long long avg;
+  MXP_QSTATS_T *st;
+
   len += sprintf(buf + len, "Linux MXP queues\n");
+  len += sprintf(buf + len, "id tid dep cnt L msz hwm    drops  expired  post/s  wait/s avg_dly max_dly name\n");
 
   for (j=1; j<MAX_QUEUES; j++){
     if (mqueue[j].state){
-      len += sprintf(buf + len, "%2d %3d %3d %3d %s\n", j,
-                 mqueue[j].taskId, mqueue[j].depth, mqueue[j].msgcnt, mqueue[j].name);
+      /* the page is limited, stop before it overflows */
+      if (len > count - 128)
+        break;
+      st   = &(mqueue[j].stats);
+      secs = (mxp_tick - st->since) / GG_TICKS_PER_SEC;
+      if (secs == 0) secs = 1;
+      avg  = st->delay_sum;
+      if (st->waits) do_div(avg, st->waits);
+      len += sprintf(buf + len, "%2d %3d %3d %3d %d %3d %3lu %8lu %8lu %7lu %7lu %7lu %7lu %s\n", j,
+                 mqueue[j].taskId, mqueue[j].depth, mqueue[j].msgcnt,
+                 mqueue[j].levels,
+                 mqueue[j].payload ? mqueue[j].payload->msgsize : 0,
+                 st->hwm, st->drops, st->expired, st->posts / secs, st->waits / secs,
+                 (unsigned long)avg,
+                 st->delay_max, mqueue_cold[j].name);
     }
   }
 
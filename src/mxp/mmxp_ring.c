@@ -0,0 +1,661 @@
+/*
+ * File name: mmxp_ring.c
+ *
+ * Description: This is part of mxp module implemented the submission and
+ *              completion rings of MXP commands. It must be included into
+ *              mmxpcore.c after the queue and timer code and is moved to
+ *              separate file to be readable only.
+ *
+ * Copyright (C) 2008 Texas Instruments, Incorporated
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2.
+ *
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any kind,
+ * whether express or implied; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+   A task that sets up its rings (MXP_RING_SETUP) maps one page with a
+   submission ring and a completion ring (MXP_RING_T, see mxp_mod.h) and
+   queues MXP commands there instead of issuing one ioctl per command.
+   MXP_RING_ENTER takes the submitted commands in order, runs every one by the
+   same function its own ioctl calls and posts one completion per command.
+   A queue wait that can not complete at once does not hold up the commands
+   behind it: it becomes a pending wait of the task.
+   A pending wait on a queue of message pointers is linked on the queue
+   (ringwait) and completed by a later post: once no task sleeps in
+   MXP_QUEUE_WAIT or MXP_QUEUE_WAIT_ANY on the queue (they were there first),
+   the post path hands the queued messages over to the oldest linked waits,
+   writes the completions to the ring and wakes up an MXP_RING_ENTER sleeping
+   for them. The post raises the queue events as any other post does.
+   A wait on a copy-mode queue has to copy the payload out in the context of
+   the task, so it is completed by the next MXP_RING_ENTER after the queue
+   gets a message, as are the timeouts.
+   MXP_RING_ENTER can also wait for a number of completions, so one system
+   call submits a batch and collects the results of earlier waits; user space
+   may as well poll the completion ring for the completions posted
+   asynchronously. The submission ring is only taken within MXP_RING_ENTER,
+   there is no kernel thread polling it.
+   The completion ring never overflows: a command is only taken when there is
+   room for its completion and for those of all pending waits.
+   Lock order: mqueue[].lock, then cq_lock of the ring.
+*/
+static MXP_RINGCTL_T       mring[MXP_TASK_MAX];
+
+#define RING_CQ_USED(r)    ((r)->cq_tail - (r)->cq_head)
+
+/* the tick has reached the deadline of wait w */
+#define RING_EXPIRED(w)    (!(w)->forever && ((long)(mxp_tick - (w)->deadline) >= 0))
+
+/* id of the wait in slot of task tid as linked on a queue, never 0 */
+#define RING_WAIT_ID(tid, slot)  ((tid) * MXP_RING_PENDING + (slot))
+#define RING_WAIT(id)      (&(mring[(id) / MXP_RING_PENDING].pending[(id) % MXP_RING_PENDING]))
+
+/*********************************************************************************
+* FUNCTION: ring_Init
+*
+* DESCRIPTION: Initialize the ring control blocks
+*********************************************************************************/
+void ring_Init(void)
+{
+  int j;
+
+  memset(mring, 0, sizeof(mring));
+  for (j = 0; j < MXP_TASK_MAX; j++){
+    mutex_init(&(mring[j].lock));
+    spin_lock_init(&(mring[j].cq_lock));
+    init_waitqueue_head(&(mring[j].wait));
+  }
+}
+
+/* room in the completion ring for one more command, the pending waits
+   included; cq_head comes from user space and is not trusted */
+static inline int ring_room(MXP_RINGCTL_T *rc)
+{
+  unsigned int used = RING_CQ_USED(rc->ring);
+
+  return (used < MXP_RING_CQ_ENTRIES) &&
+         ((used + rc->npending) < MXP_RING_CQ_ENTRIES);
+}
+
+/* post a completion, ring_room was checked before; cq_lock is held */
+static void ring_cqe(MXP_RINGCTL_T *rc, unsigned long user_data, int result,
+                     int prio, void *msg_ptr, unsigned long arg)
+{
+  MXP_RING_T *r = rc->ring;
+  MXP_CQE_T  *cqe = &(r->cq[r->cq_tail & (MXP_RING_CQ_ENTRIES - 1)]);
+
+  cqe->user_data = user_data;
+  cqe->result    = result;
+  cqe->prio      = prio;
+  cqe->msg_ptr   = msg_ptr;
+  cqe->arg       = arg;
+
+  /* the entry is written before user space sees the new tail */
+  smp_wmb();
+  r->cq_tail++;
+  rc->completed++;
+}
+
+/* post the completion of a command, cmd holds the result of a queue wait */
+static void ring_complete(MXP_RINGCTL_T *rc, unsigned long user_data, int result,
+                          MXP_CMD_T *cmd)
+{
+  unsigned long irq_st;
+
+  spin_lock_irqsave(&(rc->cq_lock), irq_st);
+  if (cmd)
+    ring_cqe(rc, user_data, result, cmd->cp.q.prio, cmd->cp.q.msg_ptr, cmd->cp.q.msgsize);
+  else
+    ring_cqe(rc, user_data, result, 0, NULL, 0);
+  spin_unlock_irqrestore(&(rc->cq_lock), irq_st);
+}
+
+/* post the completion of pending wait w and free its slot; cq_lock is held */
+static void ring_done(MXP_RINGCTL_T *rc, MXP_RING_WAIT_T *w, int result,
+                      int prio, void *msg_ptr, unsigned long arg)
+{
+  ring_cqe(rc, w->user_data, result, prio, msg_ptr, arg);
+  w->qid = 0;
+  rc->npending--;
+}
+
+/* take ring wait id off the list of queue qid, the queue is locked */
+static void ring_unlink(int qid, int id)
+{
+  short *p = &(mqueue[qid].ringwait);
+  int prev = 0;
+
+  while (*p && (*p != id)){
+    prev = *p;
+    p = &(RING_WAIT(*p)->next);
+  }
+  if (*p == 0)
+    return;
+
+  *p = RING_WAIT(id)->next;
+  if (mqueue[qid].ringwait_tail == id)
+    mqueue[qid].ringwait_tail = prev;
+}
+
+/*********************************************************************************
+* FUNCTION: ring_qComplete
+*
+* DESCRIPTION: complete the oldest ring wait linked on queue qid with result and
+*              message data taken from level lvl. The queue post path calls it
+*              for every message it hands over, the queue delete for every
+*              linked wait; the queue is locked.
+*********************************************************************************/
+static void ring_qComplete(int qid, int result, int lvl, void *data)
+{
+  int id = mqueue[qid].ringwait;
+  MXP_RINGCTL_T *rc = &mring[id / MXP_RING_PENDING];
+
+  spin_lock(&(rc->cq_lock));
+  ring_unlink(qid, id);
+  ring_done(rc, RING_WAIT(id), result, lvl, data, 0);
+  spin_unlock(&(rc->cq_lock));
+
+  wake_up(&(rc->wait));
+}
+
+/* try to take a message for queue wait w, ERR_QEMPTY if there is none yet */
+static int ring_tryWait(MXP_RING_WAIT_T *w, MXP_CMD_T *cmd)
+{
+  memset(cmd, 0, sizeof(MXP_CMD_T));
+  cmd->cp.q.qid     = w->qid;
+  cmd->cp.q.timeout = MX_NO_BLOCK;
+  cmd->cp.q.msg_ptr = w->msg_ptr;
+  cmd->cp.q.msgsize = w->msgsize;
+
+  return mxp_q_wait(cmd);
+}
+
+/* an older wait of the task on the queue of w is pending and comes first;
+   only ring_reap completes waits on copy-mode queues, so only those count */
+static int ring_older(MXP_RINGCTL_T *rc, MXP_RING_WAIT_T *w)
+{
+  int j;
+
+  for (j = 0; j < MXP_RING_PENDING; j++)
+    if ((rc->pending[j].qid == w->qid) && !rc->pending[j].async &&
+        (&(rc->pending[j]) != w) && ((long)(rc->pending[j].seq - w->seq) < 0))
+      return 1;
+  return 0;
+}
+
+/*********************************************************************************
+* FUNCTION: ring_pend
+*
+* DESCRIPTION: make queue wait w of task tid pending, there is a free slot.
+*              A wait on a queue of message pointers is linked on the queue,
+*              unless the queue got a message since the try: then the message
+*              is taken for it. Returns ERR_QEMPTY once the wait is pending, else
+*              the result of the wait with the message in cmd.
+*********************************************************************************/
+static int ring_pend(MXP_RINGCTL_T *rc, int tid, MXP_RING_WAIT_T *wait, MXP_CMD_T *cmd)
+{
+  unsigned long irq_st;
+  MXP_RING_WAIT_T *w;
+  int qid = wait->qid;
+  int slot, id, ret;
+
+  /* npending < MXP_RING_PENDING, so there is one */
+  for (slot = 0; rc->pending[slot].qid; slot++)
+    ;
+  w  = &(rc->pending[slot]);
+  id = RING_WAIT_ID(tid, slot);
+
+  while (1){
+    if (!q_lock(qid, &irq_st))
+      return ERR_QIDINV;
+    if ((mqueue[qid].payload != NULL) || (mqueue[qid].msgcnt == 0))
+      break;
+    Q_UNLOCK(qid, irq_st);
+    if ((ret = ring_tryWait(wait, cmd)) != ERR_QEMPTY)
+      return ret;
+  }
+
+  *w = *wait;
+  w->seq   = rc->seq++;
+  w->next  = 0;
+  w->async = (mqueue[qid].payload == NULL);
+  if (w->async){
+    if (mqueue[qid].ringwait)
+      RING_WAIT(mqueue[qid].ringwait_tail)->next = id;
+    else
+      mqueue[qid].ringwait = id;
+    mqueue[qid].ringwait_tail = id;
+  }
+
+  spin_lock(&(rc->cq_lock));
+  rc->npending++;
+  spin_unlock(&(rc->cq_lock));
+  Q_UNLOCK(qid, irq_st);
+  return ERR_QEMPTY;
+}
+
+/*********************************************************************************
+* FUNCTION: ring_reap
+*
+* DESCRIPTION: complete the pending waits on copy-mode queues that got a
+*              message and the waits that timed out. The waits of one queue are
+*              served in submission order.
+*********************************************************************************/
+static void ring_reap(MXP_RINGCTL_T *rc)
+{
+  MXP_RING_WAIT_T *w;
+  unsigned long irq_st;
+  unsigned long fl;
+  MXP_CMD_T cmd;
+  int qid, j;
+  int ret;
+
+  for (j = 0; j < MXP_RING_PENDING; j++){
+    w = &(rc->pending[j]);
+    if ((qid = w->qid) == 0)
+      continue;
+
+    if (w->async){
+      /* completed by the post path, unless it times out first */
+      if (!RING_EXPIRED(w) || !q_lock(qid, &irq_st))
+        continue; /* a queue delete completes it */
+      spin_lock(&(rc->cq_lock));
+      if (w->qid == qid){
+        ring_unlink(qid, RING_WAIT_ID(rc - mring, j));
+        ring_done(rc, w, ERR_TIMEOUT, 0, NULL, 0);
+      }
+      spin_unlock(&(rc->cq_lock));
+      Q_UNLOCK(qid, irq_st);
+      continue;
+    }
+
+    if (ring_older(rc, w))
+      continue;
+
+    ret = ring_tryWait(w, &cmd);
+    if ((ret == ERR_QEMPTY) && RING_EXPIRED(w))
+      ret = ERR_TIMEOUT;
+    if (ret == ERR_QEMPTY)
+      continue;
+
+    /* the room was reserved when the wait was taken */
+    spin_lock_irqsave(&(rc->cq_lock), fl);
+    if (ret == ERR_TIMEOUT)
+      ring_done(rc, w, ret, 0, NULL, 0);
+    else
+      ring_done(rc, w, ret, cmd.cp.q.prio, cmd.cp.q.msg_ptr, cmd.cp.q.msgsize);
+    spin_unlock_irqrestore(&(rc->cq_lock), fl);
+  }
+}
+
+/* does pending wait w on a copy-mode queue need a pass of ring_reap, the
+   caller is on the wait queue of its queue already */
+static inline int ring_ready(MXP_RING_WAIT_T *w)
+{
+  return (mqueue[w->qid].msgcnt != 0) || (mqueue[w->qid].state == 0) || RING_EXPIRED(w);
+}
+
+/*********************************************************************************
+* FUNCTION: ring_submit
+*
+* DESCRIPTION: run up to max submitted commands in order, returns the number
+*              taken
+*********************************************************************************/
+static int ring_submit(MXP_RINGCTL_T *rc, int max)
+{
+  MXP_RING_T *r = rc->ring;
+  MXP_RING_WAIT_T wait;
+  MXP_SQE_T sqe;
+  MXP_CMD_T cmd;
+  int taken = 0;
+  int ret;
+
+  while ((taken < max) && (r->sq_head != r->sq_tail) && ring_room(rc)){
+    /* read the entry after the tail, then take a copy user space can't change */
+    smp_rmb();
+    sqe = r->sq[r->sq_head & (MXP_RING_SQ_ENTRIES - 1)];
+
+    memset(&cmd, 0, sizeof(cmd));
+    switch (sqe.op){
+      case MXP_SQE_NOP:
+        ret = ERR_NOERR;
+        break;
+
+      case MXP_SQE_QUEUE_POST:
+        cmd.cp.q.qid      = sqe.id;
+        cmd.cp.q.msg_ptr  = sqe.msg_ptr;
+        cmd.cp.q.msgsize  = sqe.arg;
+        cmd.cp.q.prio     = sqe.prio;
+        cmd.cp.q.flags    = sqe.flags;
+        ret = mxp_q_post(&cmd);
+        break;
+
+      case MXP_SQE_QUEUE_WAIT:
+        if ((sqe.timeout != MX_NO_BLOCK) && (rc->npending >= MXP_RING_PENDING))
+          return taken; /* taken by a later pass, after a wait completes */
+
+        memset(&wait, 0, sizeof(wait));
+        wait.user_data = sqe.user_data;
+        wait.qid       = sqe.id;
+        wait.msg_ptr   = sqe.msg_ptr;
+        wait.msgsize   = sqe.arg;
+        wait.forever   = (sqe.timeout == MX_INDEFINITE);
+        wait.deadline  = mxp_tick + sqe.timeout;
+        wait.seq       = rc->seq;
+
+        /* waits of the queue submitted before go first */
+        ret = ring_older(rc, &wait) ? ERR_QEMPTY : ring_tryWait(&wait, &cmd);
+
+        if ((ret == ERR_QEMPTY) && (sqe.timeout != MX_NO_BLOCK) &&
+            ((ret = ring_pend(rc, rc - mring, &wait, &cmd)) == ERR_QEMPTY)){
+          r->sq_head++;
+          taken++;
+          continue;
+        }
+        break;
+
+      case MXP_SQE_EVENT_POST:
+        cmd.cp.ev.tid     = sqe.id;
+        cmd.cp.ev.events  = sqe.arg;
+        ret = mxp_ev_post(&cmd);
+        break;
+
+      case MXP_SQE_TMR_START:
+        cmd.cp.tmr.tmr_id  = sqe.id;
+        cmd.cp.tmr.timeout = sqe.timeout;
+        cmd.cp.tmr.reload  = sqe.arg;
+        ret = mxp_tmrStart(&cmd);
+        break;
+
+      case MXP_SQE_TMR_ABORT:
+        cmd.cp.tmr.tmr_id  = sqe.id;
+        ret = mxp_tmrAbort(&cmd);
+        break;
+
+      default:
+        ret = ERR_INV_SYS_CALL;
+        break;
+    }
+
+    ring_complete(rc, sqe.user_data, ret,
+                  ((sqe.op == MXP_SQE_QUEUE_WAIT) && (ret == ERR_NOERR)) ? &cmd : NULL);
+    r->sq_head++;
+    taken++;
+  }
+
+  return taken;
+}
+
+/*********************************************************************************
+* FUNCTION: ring_sleep
+*
+* DESCRIPTION: sleep until a completion is posted by the queue post path, a
+*              pending wait may complete or jif jiffies pass, returns the
+*              jiffies left or -ERESTARTSYS
+*********************************************************************************/
+static long ring_sleep(MXP_RINGCTL_T *rc, long jif)
+{
+  wait_queue_t wait[MXP_RING_PENDING];
+  wait_queue_t cq_wait;
+  MXP_RING_WAIT_T *w;
+  unsigned long completed = rc->completed;
+  unsigned long irq_st;
+  unsigned long left;
+  long t = jif;
+  int on[MXP_RING_PENDING];
+  int ready = 0;
+  int j;
+
+  init_waitqueue_entry(&cq_wait, current);
+  add_wait_queue(&(rc->wait), &cq_wait);
+
+  for (j = 0; j < MXP_RING_PENDING; j++){
+    w = &(rc->pending[j]);
+    on[j] = 0;
+    if (w->qid == 0)
+      continue;
+
+    /* wake up for the nearest deadline */
+    if (!w->forever){
+      left = ((long)(w->deadline - mxp_tick) > 0) ? (w->deadline - mxp_tick) : 0;
+      left = (left * HZ + GG_TICKS_PER_SEC - 1) / GG_TICKS_PER_SEC;
+      if ((long)left < t)
+        t = left;
+    }
+
+    /* a copy-mode queue wakes us up for the message */
+    if (w->async)
+      continue;
+    on[j] = q_lock(w->qid, &irq_st);
+    if (!on[j]){
+      ready = 1; /* the queue is gone, the wait completes with an error */
+      continue;
+    }
+    mqueue[w->qid].waitany++;
+    Q_UNLOCK(w->qid, irq_st);
+    init_waitqueue_entry(&wait[j], current);
+    add_wait_queue(&(mqueue[w->qid].queue_lock), &wait[j]);
+  }
+
+  /* a post after this check sees waitany or the linked wait and wakes us,
+     schedule returns at once */
+  set_current_state(TASK_INTERRUPTIBLE);
+  if (rc->completed != completed)
+    ready = 1;
+  for (j = 0; (j < MXP_RING_PENDING) && !ready; j++)
+    if (on[j] && ring_ready(&(rc->pending[j])))
+      ready = 1;
+
+  if (!ready && (t > 0)){
+    if (signal_pending(current))
+      jif = -ERESTARTSYS;
+    else {
+      /* the time slept counts against the caller's timeout only */
+      left = schedule_timeout(t);
+      if (jif != MAX_SCHEDULE_TIMEOUT)
+        jif -= (t - left);
+    }
+  }
+  __set_current_state(TASK_RUNNING);
+
+  for (j = 0; j < MXP_RING_PENDING; j++){
+    if (!on[j])
+      continue;
+    w = &(rc->pending[j]);
+    remove_wait_queue(&(mqueue[w->qid].queue_lock), &wait[j]);
+    Q_LOCK(w->qid, irq_st);
+    mqueue[w->qid].waitany--;
+    Q_UNLOCK(w->qid, irq_st);
+  }
+  remove_wait_queue(&(rc->wait), &cq_wait);
+
+  return jif;
+}
+
+/*********************************************************************************
+* FUNCTION: ring_free
+*
+* DESCRIPTION: drop the rings of task tid, the pending waits are dropped with them;
+*              a mapping of the page keeps it until it is unmapped
+*********************************************************************************/
+static void ring_free(int tid)
+{
+  MXP_RINGCTL_T *rc = &mring[tid];
+  MXP_RING_WAIT_T *w;
+  MXP_RING_T *r;
+  unsigned long irq_st;
+  int qid, j;
+
+  mutex_lock(&(rc->lock));
+  if (rc->ring){
+    /* no post may complete a wait of the task any more */
+    for (j = 0; j < MXP_RING_PENDING; j++){
+      w = &(rc->pending[j]);
+      if (((qid = w->qid) == 0) || !w->async || !q_lock(qid, &irq_st))
+        continue;
+      spin_lock(&(rc->cq_lock));
+      if (w->qid == qid)
+        ring_unlink(qid, RING_WAIT_ID(tid, j));
+      spin_unlock(&(rc->cq_lock));
+      Q_UNLOCK(qid, irq_st);
+    }
+
+    spin_lock_irqsave(&(rc->cq_lock), irq_st);
+    r = rc->ring;
+    rc->ring     = NULL;
+    rc->npending = 0;
+    for (j = 0; j < MXP_RING_PENDING; j++)
+      rc->pending[j].qid = 0;
+    spin_unlock_irqrestore(&(rc->cq_lock), irq_st);
+    free_page((unsigned long)r);
+  }
+  mutex_unlock(&(rc->lock));
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_ring_setup
+*
+* DESCRIPTION: allocate the rings of a task
+*********************************************************************************/
+static int mxp_ring_setup(MXP_CMD_T*  msg)
+{
+  int tid = msg->cp.ring.tid;
+  MXP_RINGCTL_T *rc;
+  int ret = ERR_NOERR;
+
+  if ((tid <= 0) || (tid >= MXP_TASK_MAX))
+    return ERR_TIDINV;
+  rc = &mring[tid];
+
+  /* busy is checked under the ring lock: ring_free of a task going away
+     takes it after busy is dropped, so no ring can be left behind */
+  mutex_lock(&(rc->lock));
+  if (!mxp_tcb[tid].busy)
+    ret = ERR_TIDINV;
+  else if (rc->ring)
+    ret = ERR_ASGN;
+  else if ((rc->ring = (MXP_RING_T*)get_zeroed_page(GFP_KERNEL)) == NULL)
+    ret = ERR_NOMEM;
+  else {
+    rc->ring->sq_entries = MXP_RING_SQ_ENTRIES;
+    rc->ring->cq_entries = MXP_RING_CQ_ENTRIES;
+    rc->npending  = 0;
+    rc->submitted = 0;
+    rc->completed = 0;
+  }
+  mutex_unlock(&(rc->lock));
+
+  return ret;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_ring_free
+*
+* DESCRIPTION:
+*********************************************************************************/
+static int mxp_ring_free(MXP_CMD_T*  msg)
+{
+  int tid = msg->cp.ring.tid;
+
+  if ((tid <= 0) || (tid >= MXP_TASK_MAX) || (mring[tid].ring == NULL))
+    return ERR_TIDINV;
+
+  ring_free(tid);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_ring_enter
+*
+* DESCRIPTION: run the submitted commands of a task and wait up to timeout ticks
+*              until complete completions were posted during this call
+*********************************************************************************/
+static int mxp_ring_enter(MXP_CMD_T*  msg)
+{
+  int tid = msg->cp.ring.tid;
+  MXP_RINGCTL_T *rc;
+  unsigned long completed;
+  int taken;
+  long jif;
+
+  if ((tid <= 0) || (tid >= MXP_TASK_MAX))
+    return ERR_TIDINV;
+  rc = &mring[tid];
+
+  if (mutex_lock_interruptible(&(rc->lock)))
+    return SYS_CONFIG_ERR;
+  if (rc->ring == NULL){
+    mutex_unlock(&(rc->lock));
+    return ERR_TIDINV;
+  }
+
+  if (msg->cp.ring.timeout == MX_INDEFINITE)
+    jif = MAX_SCHEDULE_TIMEOUT;
+  else
+    jif = (msg->cp.ring.timeout * HZ + GG_TICKS_PER_SEC - 1) / GG_TICKS_PER_SEC;
+
+  /* the completions the post path writes meanwhile count as well */
+  completed = rc->completed;
+  ring_reap(rc);
+  taken = ring_submit(rc, msg->cp.ring.submit);
+
+  while (((int)(rc->completed - completed) < msg->cp.ring.complete) &&
+         rc->npending && (jif > 0)){
+    jif = ring_sleep(rc, jif);
+    ring_reap(rc);
+    /* a wait completed, a waiting submission may fit now */
+    taken += ring_submit(rc, msg->cp.ring.submit - taken);
+  }
+
+  rc->submitted += taken;
+  msg->cp.ring.submit   = taken;
+  msg->cp.ring.complete = rc->completed - completed;
+  msg->cp.ring.pending  = rc->npending;
+  mutex_unlock(&(rc->lock));
+
+  if (jif == -ERESTARTSYS){
+    printk( KERN_INFO "mxp_ring_enter for task %d waken up by unexpected signal\n", tid);
+    return SYS_CONFIG_ERR;
+  }
+
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_ring_proc
+*
+* DESCRIPTION: form the output for /proc/timxp/ring file
+*********************************************************************************/
+static int mxp_ring_proc(char *buf, char **start, off_t offset,
+                   int count, int *eof, void *data)
+{
+  MXP_RING_T *r;
+  int len = 0;
+  int j;
+
+  len += sprintf(buf + len, "tid name              sq  cq pending  submitted  completed\n");
+  for (j = 1; j < MXP_TASK_MAX; j++){
+    /* the page is limited, stop before it overflows */
+    if (len > count - 128)
+      break;
+    /* an MXP_RING_ENTER holds the lock while it sleeps, don't wait for it */
+    if (!mutex_trylock(&(mring[j].lock))){
+      if (mring[j].ring)
+        len += sprintf(buf + len, "%3d %-16s busy\n", j, mxp_tcb[j].name);
+      continue;
+    }
+    if ((r = mring[j].ring) != NULL)
+      len += sprintf(buf + len, "%3d %-16s %3u %3u %7d %10lu %10lu\n", j, mxp_tcb[j].name,
+                     r->sq_tail - r->sq_head, RING_CQ_USED(r), mring[j].npending,
+                     mring[j].submitted, mring[j].completed);
+    mutex_unlock(&(mring[j].lock));
+  }
+
+  *eof = 1;
+  return len;
+}
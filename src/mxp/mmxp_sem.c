@@ -0,0 +1,327 @@
+/*
+ * File name: mmxp_sem.c
+ *
+ * Description: This is part of mxp module implemented counting semaphores.
+ *              It must be included into mmxpcore.c and is moved to separate
+ *              file to be readable only.
+ *
+ * Copyright (C) 2008 Texas Instruments, Incorporated
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2.
+ *
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any kind,
+ * whether express or implied; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+   The token count of every semaphore lives in one page (MXP_SHM_T, shared with
+   the mutexes) that user space maps with mmap at MXP_MMAP_SEM_PGOFF; entry sid
+   of its sem[] belongs to semaphore sid.
+   An uncontended XsWait takes a token with a compare-and-swap on count and an
+   uncontended XsPost adds one with an atomic add, neither enters the kernel.
+   XsWait enters the kernel (MXP_SEM_WAIT) only when there is no token; the
+   waiter counts itself in waiters before it checks count again and sleeps.
+   XsPost enters the kernel (MXP_SEM_POST with count 0) only when it sees
+   waiters after its add. Both sides change one word with a full barrier
+   before they read the other one, so a post never misses a waiter.
+   The kernel only touches count with atomic operations, the same ones user
+   space uses (ldrex/strex on ARMv6 and up).
+*/
+static MXP_SEM_T           msem[MAX_SEMAPHORES];
+static MXP_SHM_T           *mxp_shm; /* the shared page */
+
+/* sem_table_lock guards the state of every semaphore going busy or free;
+   the kernel side of wait and post holds it around each counter update so a
+   semaphore deleted (and maybe created again) meanwhile is not touched */
+static DEFINE_SPINLOCK(sem_table_lock);
+
+/* semaphore name index */
+static MXP_NAME_IDX_T      sem_names;
+static short               sem_names_next[MAX_SEMAPHORES];
+
+/* semaphore ID allocator */
+static MXP_ID_ALLOC_T      sem_ids;
+static DECLARE_BITMAP(sem_ids_map, MAX_SEMAPHORES);
+static short               sem_ids_stack[MAX_SEMAPHORES];
+
+#define SEM_COUNT(sid)     ((atomic_t*)&(mxp_shm->sem[sid].count))
+#define SEM_WAITERS(sid)   ((atomic_t*)&(mxp_shm->sem[sid].waiters))
+#define SEM_INVALID(sid)   (((sid) <= 0) || ((sid) >= MAX_SEMAPHORES) || (msem[sid].state == 0))
+
+/*********************************************************************************
+* FUNCTION: sem_Init
+*
+* DESCRIPTION: Initialize semaphore pull, returns nonzero if there is no memory
+*              for the shared page
+*********************************************************************************/
+int sem_Init(void)
+{
+  int j;
+
+  mxp_shm = (MXP_SHM_T*)get_zeroed_page(GFP_KERNEL);
+  if (!mxp_shm)
+    return 1;
+
+  memset(msem, 0, sizeof(msem));
+  for (j = 0; j < MAX_SEMAPHORES; j++)
+    init_waitqueue_head(&(msem[j].wait));
+  msem[0].state = 1; /* we don't use semaphore #0 */
+
+  nidx_Init(&sem_names, sem_names_next, msem, sizeof(MXP_SEM_T),
+            offsetof(MXP_SEM_T, name), MAX_SEMAPHORES);
+  idalloc_Init(&sem_ids, sem_ids_map, sem_ids_stack, MAX_SEMAPHORES, 1);
+  return 0;
+}
+
+/* take a token if there is one */
+static inline int sem_take(int sid)
+{
+  int c;
+
+  while ((c = atomic_read(SEM_COUNT(sid))) > 0)
+    if (atomic_cmpxchg(SEM_COUNT(sid), c, c - 1) == c)
+      return 1;
+
+  return 0;
+}
+
+/* take a token unless semaphore sid was deleted since generation gen:
+   1 - got it, 0 - none there, -1 - deleted */
+static int sem_takeGen(int sid, unsigned int gen)
+{
+  unsigned long irq_st;
+  int ret = -1;
+
+  spin_lock_irqsave(&sem_table_lock, irq_st);
+  if (msem[sid].gen == gen)
+    ret = sem_take(sid);
+  spin_unlock_irqrestore(&sem_table_lock, irq_st);
+  return ret;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sem_create
+*
+* DESCRIPTION:
+*********************************************************************************/
+static int mxp_sem_create(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int sid;
+
+  if (msg->cp.sem.count < 0)
+    return ERR_NOSEM;
+
+  spin_lock_irqsave(&sem_table_lock, irq_st);
+
+  /* check whether the named semaphore already exists */
+  if (nidx_Find(&sem_names, msg->cp.sem.name) != -1){
+    spin_unlock_irqrestore(&sem_table_lock, irq_st);
+    return ERR_ASGN;
+  }
+
+  if ((sid = idalloc_Get(&sem_ids)) < 0){
+    spin_unlock_irqrestore(&sem_table_lock, irq_st);
+    return ERR_NOSCB;
+  }
+
+  msem[sid].state  = 1;
+  msem[sid].tokens = msg->cp.sem.count;
+  strcpy(msem[sid].name, msg->cp.sem.name);
+  nidx_Insert(&sem_names, sid);
+  atomic_set(SEM_WAITERS(sid), 0);
+  atomic_set(SEM_COUNT(sid), msg->cp.sem.count);
+
+  msg->cp.sem.sid = sid;
+
+  spin_unlock_irqrestore(&sem_table_lock, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sem_delete
+*
+* DESCRIPTION: the tasks waiting on the semaphore return ERR_SUNASGN
+*********************************************************************************/
+static int mxp_sem_delete(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int sid = msg->cp.sem.sid;
+
+  spin_lock_irqsave(&sem_table_lock, irq_st);
+  if (SEM_INVALID(sid)){
+    spin_unlock_irqrestore(&sem_table_lock, irq_st);
+    return ERR_SIDINV;
+  }
+
+  nidx_Remove(&sem_names, sid);
+  msem[sid].state = 0;
+  msem[sid].gen++;
+  idalloc_Put(&sem_ids, sid);
+
+  spin_unlock_irqrestore(&sem_table_lock, irq_st);
+  wake_up(&(msem[sid].wait));
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sem_identify
+*
+* DESCRIPTION: find sid by name
+*********************************************************************************/
+static int mxp_sem_identify(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int ret = ERR_NOERR;
+
+  spin_lock_irqsave(&sem_table_lock, irq_st);
+
+  if ((msg->cp.sem.sid = nidx_Find(&sem_names, msg->cp.sem.name)) == -1)
+    ret = ERR_INVNAME;
+
+  spin_unlock_irqrestore(&sem_table_lock, irq_st);
+  return ret;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sem_wait
+*
+* DESCRIPTION: take a token, sleep up to timeout ticks for it
+*********************************************************************************/
+static int mxp_sem_wait(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int sid = msg->cp.sem.sid;
+  unsigned int gen;
+  int got = 0;
+  long jif;
+  long ret;
+
+  if (msg->cp.sem.timeout == MX_INDEFINITE)
+    jif = MAX_SCHEDULE_TIMEOUT;
+  else
+    jif = (msg->cp.sem.timeout * HZ + GG_TICKS_PER_SEC - 1) / GG_TICKS_PER_SEC;
+
+  spin_lock_irqsave(&sem_table_lock, irq_st);
+  if (SEM_INVALID(sid)){
+    spin_unlock_irqrestore(&sem_table_lock, irq_st);
+    return ERR_SIDINV;
+  }
+  gen = msem[sid].gen;
+
+  if (sem_take(sid)){
+    spin_unlock_irqrestore(&sem_table_lock, irq_st);
+    return ERR_NOERR;
+  }
+
+  if (msg->cp.sem.timeout == MX_NO_BLOCK){
+    spin_unlock_irqrestore(&sem_table_lock, irq_st);
+    return ERR_NOSEM;
+  }
+
+  /* count ourselves before the last look at count, see above */
+  atomic_inc_return(SEM_WAITERS(sid)); /* full barrier */
+  spin_unlock_irqrestore(&sem_table_lock, irq_st);
+
+  ret = wait_event_interruptible_timeout(msem[sid].wait,
+                   (got = sem_takeGen(sid, gen)) != 0, jif);
+
+  /* a semaphore created again in the slot has its own waiters count */
+  spin_lock_irqsave(&sem_table_lock, irq_st);
+  if (msem[sid].gen == gen)
+    atomic_dec(SEM_WAITERS(sid));
+  spin_unlock_irqrestore(&sem_table_lock, irq_st);
+
+  if (got < 0)
+    return ERR_SUNASGN;
+
+  if (got > 0)
+    return ERR_NOERR;
+
+  if (ret == -ERESTARTSYS){
+    printk( KERN_INFO "mxp_sem_wait for semId %d waken up by unexpected signal\n", sid);
+    return SYS_CONFIG_ERR;
+  }
+
+  return ERR_TIMEOUT;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sem_post
+*
+* DESCRIPTION: add count tokens and wake the waiters; count 0 only wakes them
+*              (user space has added its token already)
+*********************************************************************************/
+static int mxp_sem_post(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int sid = msg->cp.sem.sid;
+  int wakeup;
+
+  if (msg->cp.sem.count < 0)
+    return ERR_NOSEM;
+
+  spin_lock_irqsave(&sem_table_lock, irq_st);
+  if (SEM_INVALID(sid)){
+    spin_unlock_irqrestore(&sem_table_lock, irq_st);
+    return ERR_SIDINV;
+  }
+
+  if (msg->cp.sem.count)
+    atomic_add_return(msg->cp.sem.count, SEM_COUNT(sid)); /* full barrier */
+  else
+    smp_mb();
+
+  wakeup = atomic_read(SEM_WAITERS(sid));
+  spin_unlock_irqrestore(&sem_table_lock, irq_st);
+
+  if (wakeup)
+    wake_up(&(msem[sid].wait));
+
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sem_inquiry
+*
+* DESCRIPTION: get the initial and the available tokens
+*********************************************************************************/
+static int mxp_sem_inquiry(MXP_CMD_T*  msg)
+{
+  int sid = msg->cp.sem.sid;
+
+  if (SEM_INVALID(sid))
+    return ERR_SIDINV;
+
+  msg->cp.sem.count = msem[sid].tokens;
+  msg->cp.sem.avail = atomic_read(SEM_COUNT(sid));
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sem_proc
+*
+* DESCRIPTION: form the output for /proc/timxp/sem file
+*********************************************************************************/
+static int mxp_sem_proc(char *buf, char **start, off_t offset,
+                   int count, int *eof, void *data)
+{
+  int len = 0;
+  int i;
+
+  len += sprintf(buf + len, " id name             tokens  avail waiters\n");
+  for (i = 1; i < MAX_SEMAPHORES; i++){
+    if (msem[i].state == 0)
+      continue;
+
+    len += sprintf(buf + len, "%3d %-16s %6d %6d %7d\n", i, msem[i].name,
+                   msem[i].tokens, atomic_read(SEM_COUNT(i)), atomic_read(SEM_WAITERS(i)));
+  }
+
+  *eof = 1;
+  return len;
+}
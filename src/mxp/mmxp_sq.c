@@ -0,0 +1,430 @@
+/*
+ * File name: mmxp_sq.c
+ *
+ * Description: This is part of mxp module implemented sorted queue management.
+ *              It must be included into mmxpcore.c and is moved to separate 
+ *              file to be readable only.
+ *
+ * Copyright (C) 2008 Texas Instruments, Incorporated
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2.
+ *
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any kind,
+ * whether express or implied; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+   Every sorted queue keeps its messages in a binary heap ordered by the integer
+   key given at post time; the smallest key is at heap[1]. Messages with equal
+   keys are delivered in post order, the sequence number breaks the tie.
+   The heap array (depth + 1 entries, entry #0 is unused) is allocated when the
+   queue is created, so post and wait never allocate memory.
+*/
+static MSG_SQUEUE_T        msqueue[MAX_SQUEUES];
+
+/* sq_table_lock guards the state of every sorted queue going busy or free,
+   each sorted queue has its own lock for everything else */
+static DEFINE_SPINLOCK(sq_table_lock);
+
+/* sorted queue name index */
+static MXP_NAME_IDX_T      sq_names;
+static short               sq_names_next[MAX_SQUEUES];
+
+/* sorted queue ID allocator */
+static MXP_ID_ALLOC_T      sq_ids;
+static DECLARE_BITMAP(sq_ids_map, MAX_SQUEUES);
+static short               sq_ids_stack[MAX_SQUEUES];
+
+#define SQ_LOCK(sqid, fl)    spin_lock_irqsave(&(msqueue[sqid].lock), fl)
+#define SQ_UNLOCK(sqid, fl)  spin_unlock_irqrestore(&(msqueue[sqid].lock), fl)
+
+/* lock sorted queue sqid, returns 0 (and leaves it unlocked) if there is none */
+static inline int sq_lock(int sqid, unsigned long *fl)
+{
+  if ((sqid <= 0) || (sqid >= MAX_SQUEUES))
+    return 0;
+
+  SQ_LOCK(sqid, *fl);
+  if (msqueue[sqid].state)
+    return 1;
+
+  SQ_UNLOCK(sqid, *fl);
+  return 0;
+}
+
+/* returns nonzero if entry a must be delivered before entry b */
+#define SQ_BEFORE(a, b) (((a)->key < (b)->key) || \
+                         (((a)->key == (b)->key) && ((int)((a)->seq - (b)->seq) < 0)))
+
+/****************************************************************************************/
+/* move the entry at index K up to its place                                            */
+static void sq_UpHeap(SQ_ENTRY_T *heap, int K)
+{
+  SQ_ENTRY_T this = heap[K];
+
+  while ((K > 1) && SQ_BEFORE(&this, &heap[K>>1])){
+    heap[K] = heap[K>>1];
+    K >>= 1;
+  }
+  heap[K] = this;
+}
+
+/****************************************************************************************/
+/* move the entry at index K down to its place                                          */
+static void sq_DownHeap(SQ_ENTRY_T *heap, int inUse, int K)
+{
+  SQ_ENTRY_T this = heap[K];
+  int J;
+
+  while ((J = K<<1) <= inUse){
+    /* choose the child which goes first */
+    if ((J < inUse) && SQ_BEFORE(&heap[J|1], &heap[J]))
+      J |= 1;
+
+    if (!SQ_BEFORE(&heap[J], &this))
+      break;
+
+    heap[K] = heap[J];
+    K = J;
+  }
+  heap[K] = this;
+}
+
+/*********************************************************************************
+* FUNCTION: sq_Init
+*
+* DESCRIPTION: Initialize sorted queue pull
+*********************************************************************************/
+void sq_Init(void)
+{
+  int j;
+
+  memset(msqueue, 0, sizeof(msqueue));
+  msqueue[0].state = 1; /* we don't use sorted queue #0 */
+  for(j=1; j<MAX_SQUEUES; j++){
+    init_waitqueue_head(&(msqueue[j].queue_lock));
+    spin_lock_init(&(msqueue[j].lock));
+  }
+
+  nidx_Init(&sq_names, sq_names_next, msqueue, sizeof(MSG_SQUEUE_T),
+            offsetof(MSG_SQUEUE_T, name), MAX_SQUEUES);
+  idalloc_Init(&sq_ids, sq_ids_map, sq_ids_stack, MAX_SQUEUES, 1);
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sq_create
+*
+* DESCRIPTION:
+*********************************************************************************/
+static int mxp_sq_create(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  SQ_ENTRY_T *heap;
+  size_t size;
+  int sqid;
+
+  if ((msg->cp.sq.depth <= 0) || (msg->cp.sq.depth > MXP_QUEUE_MAX_DEPTH))
+    return ERR_NOMEM;
+
+  /* heap slot 0 is unused */
+  size = (size_t)msg->cp.sq.depth + 1;
+  if (size > ((size_t)-1) / sizeof(SQ_ENTRY_T))
+    return ERR_NOMEM;
+
+  /* allocate the heap before going atomic */
+  heap = kmalloc(sizeof(SQ_ENTRY_T) * size, GFP_KERNEL);
+  if (!heap)
+    return ERR_NOMEM;
+
+  spin_lock_irqsave(&sq_table_lock, irq_st);
+
+  /* check whether the named queue already exists */
+  if (nidx_Find(&sq_names, msg->cp.sq.name) != -1){
+    spin_unlock_irqrestore(&sq_table_lock, irq_st);
+    kfree(heap);
+    return ERR_ASGN;
+  }
+
+  /* try to allocate sqcb */
+  if ((sqid = idalloc_Get(&sq_ids)) < 0){
+    spin_unlock_irqrestore(&sq_table_lock, irq_st);
+    kfree(heap);
+    return ERR_NOSQCB;
+  }
+
+  spin_lock(&(msqueue[sqid].lock));
+  msqueue[sqid].state    = 1;
+  strcpy(msqueue[sqid].name, msg->cp.sq.name);
+  nidx_Insert(&sq_names, sqid);
+  msqueue[sqid].heap     = heap;
+  msqueue[sqid].msgcnt   = 0;
+  msqueue[sqid].seq      = 0;
+  msqueue[sqid].depth    = msg->cp.sq.depth;
+  msqueue[sqid].taskId   = msg->cp.sq.tid;
+  msqueue[sqid].events   = msg->cp.sq.events;
+  msqueue[sqid].wait4msg = 0;
+
+  msg->cp.sq.sqid = sqid;
+
+  spin_unlock(&(msqueue[sqid].lock));
+  spin_unlock_irqrestore(&sq_table_lock, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sq_delete
+*
+* DESCRIPTION:
+*********************************************************************************/
+static int mxp_sq_delete(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  SQ_ENTRY_T *heap;
+  int sqid = msg->cp.sq.sqid;
+  int wakeup_q;
+
+  if ((sqid <= 0) || (sqid >= MAX_SQUEUES))
+    return ERR_SQIDINV;
+
+  spin_lock_irqsave(&sq_table_lock, irq_st);
+  spin_lock(&(msqueue[sqid].lock));
+  if (msqueue[sqid].state == 0){
+    spin_unlock(&(msqueue[sqid].lock));
+    spin_unlock_irqrestore(&sq_table_lock, irq_st);
+    return ERR_SQIDINV;
+  }
+
+  heap = msqueue[sqid].heap;
+  msqueue[sqid].heap   = NULL;
+  msqueue[sqid].msgcnt = 0;
+  nidx_Remove(&sq_names, sqid);
+  msqueue[sqid].state  = 0;
+  idalloc_Put(&sq_ids, sqid);
+  wakeup_q = msqueue[sqid].wait4msg;
+  msqueue[sqid].wait4msg = 0;
+
+  spin_unlock(&(msqueue[sqid].lock));
+  spin_unlock_irqrestore(&sq_table_lock, irq_st);
+  /* a blocked waiter returns ERR_SQUNASGN */
+  if (wakeup_q)
+    wake_up(&(msqueue[sqid].queue_lock));
+  kfree(heap);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sq_delete_all
+*
+* DESCRIPTION:
+*********************************************************************************/
+static int mxp_sq_delete_all(void)
+{
+  MXP_CMD_T  msg;
+  int        j;
+
+  for (j=1; j<MAX_SQUEUES; j++){
+    if (msqueue[j].state > 0){
+      msg.cp.sq.sqid = j;
+      mxp_sq_delete(&msg);
+    }
+  }
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sq_post
+*
+* DESCRIPTION: insert the message according to its key, O(log n)
+*********************************************************************************/
+static int mxp_sq_post(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  MSG_SQUEUE_T *sq;
+  int sqid = msg->cp.sq.sqid;
+  int wakeup_q = 0;
+  int wakeup_t = 0;
+  MXP_CMD_T  msg_ev;
+
+  if (!sq_lock(sqid, &irq_st))
+    return ERR_SQIDINV;
+  sq = &msqueue[sqid];
+
+  if (sq->msgcnt >= sq->depth){
+    SQ_UNLOCK(sqid, irq_st);
+    return ERR_SQFULL;
+  }
+
+  sq->msgcnt++;
+  sq->heap[sq->msgcnt].key = msg->cp.sq.key;
+  sq->heap[sq->msgcnt].seq = sq->seq++;
+  sq->heap[sq->msgcnt].msg = msg->cp.sq.msg_ptr;
+  sq_UpHeap(sq->heap, sq->msgcnt);
+
+  if (sq->wait4msg > 0){
+    sq->wait4msg = 0;
+    wakeup_q = 1;
+  }
+
+  if (sq->taskId != 0){
+    wakeup_t = sq->taskId;
+    msg_ev.cp.ev.tid    = wakeup_t;
+    msg_ev.cp.ev.events = sq->events;
+  }
+
+  SQ_UNLOCK(sqid, irq_st);
+  if (wakeup_q)
+    wake_up(&(sq->queue_lock));
+
+  if (wakeup_t)
+    return mxp_ev_post(&msg_ev);
+
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sq_wait
+*
+* DESCRIPTION: take the message with the smallest key, O(log n)
+*********************************************************************************/
+static int mxp_sq_wait(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  MSG_SQUEUE_T *sq;
+  int sqid = msg->cp.sq.sqid;
+  int ret;
+
+  if (!sq_lock(sqid, &irq_st))
+    return ERR_SQIDINV;
+  sq = &msqueue[sqid];
+
+  while(1){
+    if (sq->msgcnt){
+      /* we have a message in the queue */
+      msg->cp.sq.msg_ptr = sq->heap[1].msg;
+      msg->cp.sq.key     = sq->heap[1].key;
+      sq->heap[1] = sq->heap[sq->msgcnt];
+      sq->msgcnt--;
+      if (sq->msgcnt > 1)
+        sq_DownHeap(sq->heap, sq->msgcnt, 1);
+      SQ_UNLOCK(sqid, irq_st);
+      return ERR_NOERR;
+    }
+
+    if (msg->cp.sq.timeout == MX_NO_BLOCK){
+      SQ_UNLOCK(sqid, irq_st);
+      return ERR_SQEMPTY;
+    }
+
+    /* if timeout is not MX_NO_BLOCK, consider it as MX_INDEFINITE */
+    sq->wait4msg = 1; /* flag that we wait a message */
+    SQ_UNLOCK(sqid, irq_st);
+    ret = wait_event_interruptible( (sq->queue_lock), sq->wait4msg == 0);
+    SQ_LOCK(sqid, irq_st);
+
+    if ( ret == -ERESTARTSYS ){
+      /* it was unexpected signal */
+      sq->wait4msg = 0;
+      SQ_UNLOCK(sqid, irq_st);
+      printk( KERN_INFO "mxp_sq_wait for squeueId %d waken up by unexpected signal\n", sqid);
+      return SYS_CONFIG_ERR;
+    }
+
+    if (sq->state == 0){
+      SQ_UNLOCK(sqid, irq_st);
+      return ERR_SQUNASGN;
+    }
+  }
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sq_peek
+*
+* DESCRIPTION: return the first message without removing it, O(1)
+*********************************************************************************/
+static int mxp_sq_peek(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int sqid = msg->cp.sq.sqid;
+
+  if (!sq_lock(sqid, &irq_st))
+    return ERR_SQIDINV;
+
+  if (msqueue[sqid].msgcnt == 0){
+    SQ_UNLOCK(sqid, irq_st);
+    return ERR_SQEMPTY;
+  }
+
+  msg->cp.sq.msg_ptr = msqueue[sqid].heap[1].msg;
+  msg->cp.sq.key     = msqueue[sqid].heap[1].key;
+
+  SQ_UNLOCK(sqid, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sq_identify
+*
+* DESCRIPTION: find sqid by name
+*********************************************************************************/
+static int mxp_sq_identify(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int ret = ERR_NOERR;
+
+  spin_lock_irqsave(&sq_table_lock, irq_st);
+
+  if ((msg->cp.sq.sqid = nidx_Find(&sq_names, msg->cp.sq.name)) == -1)
+    ret = ERR_INVNAME;
+
+  spin_unlock_irqrestore(&sq_table_lock, irq_st);
+  return ret;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_sq_inquiry
+*
+* DESCRIPTION: get number of messages
+*********************************************************************************/
+static int mxp_sq_inquiry(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  int sqid = msg->cp.sq.sqid;
+
+  if (!sq_lock(sqid, &irq_st))
+    return ERR_SQIDINV;
+
+  msg->cp.sq.depth = msqueue[sqid].msgcnt;
+
+  SQ_UNLOCK(sqid, irq_st);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_squeue_proc
+*
+* DESCRIPTION: form the output for /proc/timxp/squeue file
+*********************************************************************************/
+static int mxp_squeue_proc(char *buf, char **start, off_t offset,
+                   int count, int *eof, void *data)
+{
+  int len = 0;
+  int j;
+  len += sprintf(buf + len, "Linux MXP sorted queues\n");
+
+  for (j=1; j<MAX_SQUEUES; j++){
+    if (msqueue[j].state){
+      /* the page is limited, stop before it overflows */
+      if (len > count - 128)
+        break;
+      len += sprintf(buf + len, "%2d %3d %3d %3d %s\n", j,
+                 msqueue[j].taskId, msqueue[j].depth, msqueue[j].msgcnt, msqueue[j].name);
+    }
+  }
+
+  *eof = 1;
+  return len;
+}
@@ -21,6 +21,7 @@
 #include <linux/proc_fs.h>
 #include <linux/mm.h>
 #include <linux/vmalloc.h>
+#include <linux/slab.h>
 
 #include <linux/version.h>
 #include <linux/unistd.h>
@@ -35,6 +36,7 @@
 #define GG_TICKS_PER_SEC 200
 
 #include <asm/irq.h>
+#include <asm/div64.h>
 
 #include "mxp_mod.h"
 #include "rtxerr.h"
@@ -57,6 +59,15 @@ void   tmrobj_Delete(TMROBJ_T *this);
 int    tmrobj_init(void);
 void   mxl_tmr_init(void);
 void   q_Init(void);
+void   sq_Init(void);
+void   fan_Init(void);
+int    sem_Init(void);
+void   mtx_Init(void);
+void   lwt_Init(void);
+void   ring_Init(void);
+static void lwt_freeTask(int tid);
+static void ring_free(int tid);
+static void ring_qComplete(int qid, int result, int lvl, void *data);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0)
 void
 #else
@@ -81,7 +92,6 @@ void tmrobj_Start(
 static unsigned long _inUse = 0;
 static unsigned long _clock   = 0;
 static unsigned long volatile mxp_tick = 0;
-static struct semaphore tmr_lock;
 
 static TMROBJ_T *_heap[MAX_TMROBJS + 1];
 
@@ -89,22 +99,167 @@ static TMROBJ_T *_heap[MAX_TMROBJS + 1];
 /***************************************************************************/
 /***************************************************************************/
 
-/* variables used to lock mxp. It should disable ISR when locked ? */
-DEFINE_SPINLOCK(mxp_lock);
-unsigned int  mxp_irq_old;
+/* MXP locking. Every object has its own spinlock, taken with interrupts
+   disabled since posts come from interrupt and tasklet context too:
+     q_table_lock, sq_table_lock,     - ID allocators, name indexes and
+     fan_table_lock, tcb_table_lock,    objects going busy or free
+     sem_table_lock, mtx_table_lock,
+     lwt_table_lock
+     mfanout[].lock                    - one fan-out object
+     mqueue[].lock, msqueue[].lock,    - one queue or mutex
+     mmutex[].lock
+     mxp_subtcb[].lock                 - the event fields of one task and
+                                         its lightweight threads
+     tmr_base_lock                     - timer object heap and MXP timers
+   Locks are only taken in the order listed above. A post to a queue drops the
+   queue lock before it posts the event to the task (the post->event chain);
+   only the low watermark event is posted with the queue lock held, which the
+   order allows. A fan-out post holds the fan-out lock across the posts to its
+   subscriber queues and the events they post. Timer callbacks run without
+   tmr_base_lock. */
+static DEFINE_SPINLOCK(tcb_table_lock);
+static DEFINE_SPINLOCK(tmr_base_lock);
 
 /* system tick */
 static unsigned int volatile irq_tick = 0;
 
+/* the CPU that services the timer interrupt also runs the tmrobj tasklet it
+   schedules (a tasklet runs on the CPU that scheduled it); a module can not
+   route an interrupt, so the timer interrupt is pinned from user space through
+   /proc/irq/<irq>/smp_affinity, /proc/timxp/affinity shows the irq */
+static unsigned int mxp_timer_irq;
+static int volatile tmr_last_cpu = -1; /* CPU tmrobj_clock ran on last */
+
+/* called by the platform timer code once the timer interrupt is requested */
+static void mxp_timer_pin(unsigned int irq)
+{
+  mxp_timer_irq = irq;
+}
+
 /*********************************************************************/
 /********** Platform dependent timer implementation ******************/
 /*********************************************************************/
 #include "mmxptimer.c"
 
+/*********************************************************************/
+/********** Hashed name index ****************************************/
+/*********************************************************************/
+#include "mmxp_name.c"
+
+/*********************************************************************/
+/********** Control block ID allocator *******************************/
+/*********************************************************************/
+#include "mmxp_id.c"
+
 /* MXP tasks control block array */
 MXP_TCB_T     *mxp_tcb;
 MXP_SUBTCB_T  mxp_subtcb[MXP_TASK_MAX];
 
+/* task name index */
+static MXP_NAME_IDX_T tcb_names;
+static short          tcb_names_next[MXP_TASK_MAX];
+
+/* task ID allocator */
+static MXP_ID_ALLOC_T tcb_ids;
+static DECLARE_BITMAP(tcb_ids_map, MXP_TASK_MAX);
+static short          tcb_ids_stack[MXP_TASK_MAX];
+
+#define TCB_LOCK(tid, fl)    spin_lock_irqsave(&(mxp_subtcb[tid].lock), fl)
+#define TCB_UNLOCK(tid, fl)  spin_unlock_irqrestore(&(mxp_subtcb[tid].lock), fl)
+
+/* lock task tid, returns 0 (and leaves it unlocked) if there is no such task */
+static inline int tcb_lock(int tid, unsigned long *fl)
+{
+  if ((tid <= 0) || (tid >= MXP_TASK_MAX))
+    return 0;
+
+  TCB_LOCK(tid, *fl);
+  if (mxp_tcb[tid].busy)
+    return 1;
+
+  TCB_UNLOCK(tid, *fl);
+  return 0;
+}
+
+/* thread of task tid with a reference taken, NULL if there is none */
+static struct task_struct *tcb_task(int tid)
+{
+  struct task_struct *p = NULL;
+  unsigned long irq_st;
+
+  if (!tcb_lock(tid, &irq_st))
+    return NULL;
+
+  if ((p = mxp_subtcb[tid].task) != NULL)
+    get_task_struct(p);
+
+  TCB_UNLOCK(tid, irq_st);
+  return p;
+}
+
+/* MXP priority to Linux scheduler mapping. Tasks at mxp_rt_prio and above run
+   SCHED_FIFO at mxp_rt_base + (priority - mxp_rt_prio), the others SCHED_NORMAL.
+   Both can be changed at runtime through /sys/module/<mod>/parameters; the new
+   mapping applies to the next MXP_TASK_SETPRIO. */
+static int mxp_rt_prio = 0;
+module_param(mxp_rt_prio, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mxp_rt_prio, "Lowest MXP priority that runs SCHED_FIFO, 0 - none");
+static int mxp_rt_base = 1;
+module_param(mxp_rt_base, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mxp_rt_base, "SCHED_FIFO priority of MXP priority mxp_rt_prio");
+
+/* Adaptive spin before sleep.
+   A task with a spin limit (MXP_TASK_SPIN) busy-waits up to spin_win us for its
+   message or event before it goes to sleep, a message that arrives in the window
+   saves the wake-up and the context switch. spin_gap is a running average of the
+   time from the start of a wait to its end, spinning or not; the window is twice
+   that while the average fits the limit and 0 while the waits are longer, so a
+   task whose messages come late stops burning CPU on its own and starts again
+   when they come quick. On UP there is nobody to post while we spin. */
+#define SPIN_STAMP()  ((unsigned int)(sched_clock() >> 10))  /* ~us */
+
+#define TCB_SPINS(tid)  (mxp_subtcb[tid].spin_max != 0)
+
+#ifdef CONFIG_SMP
+/* spin while condition is false, returns nonzero if it became true */
+#define tcb_spin(tid, condition)                                    \
+({                                                                  \
+  unsigned int __t0 = SPIN_STAMP();                                 \
+  int __hit = 0;                                                    \
+  if (num_online_cpus() > 1)                                        \
+    while ((SPIN_STAMP() - __t0) < mxp_subtcb[tid].spin_win){       \
+      if (condition){                                               \
+        __hit = 1;                                                  \
+        break;                                                      \
+      }                                                             \
+      if (need_resched())                                           \
+        break;                                                      \
+      cpu_relax();                                                  \
+    }                                                               \
+  __hit;                                                            \
+})
+#else
+#define tcb_spin(tid, condition)  0
+#endif
+
+/* account a wait of task tid started at t0 and tune the spin window */
+static void tcb_spinDone(int tid, unsigned int t0, int hit)
+{
+  MXP_SUBTCB_T *st = &mxp_subtcb[tid];
+  unsigned int gap = SPIN_STAMP() - t0;
+
+  if (hit)
+    st->spin_hits++;
+  else if (st->spin_win)
+    st->spin_misses++;
+
+  /* one long sleep must not keep the window closed for long */
+  if (gap > 4 * st->spin_max)
+    gap = 4 * st->spin_max;
+  st->spin_gap = (3 * st->spin_gap + gap) / 4;
+  st->spin_win = (st->spin_gap <= st->spin_max) ? min(2 * st->spin_gap, st->spin_max) : 0;
+}
+
 /***************************************************************************/
 DECLARE_TASKLET(tmrobj_tasklet, tmrobj_clock, 0);
 
@@ -115,12 +270,14 @@ DECLARE_TASKLET(tmrobj_tasklet, tmrobj_clock, 0);
 *********************************************************************************/
 int tcb_by_name(char *name){
 
-  int j;
-  for (j = 1; j < MXP_TASK_MAX; j++)
-    if ((mxp_tcb[j].busy != 0) && (!strcmp(mxp_tcb[j].name, name)))
-      return j;
+  unsigned long irq_st;
+  int tid;
+
+  spin_lock_irqsave(&tcb_table_lock, irq_st);
+  tid = nidx_Find(&tcb_names, name); /* -1 if name not found */
+  spin_unlock_irqrestore(&tcb_table_lock, irq_st);
 
-  return -1; /*  name not found */
+  return tid;
 }
 EXPORT_SYMBOL(tcb_by_name);
 /*********************************************************************************
@@ -130,16 +287,9 @@ EXPORT_SYMBOL(tcb_by_name);
 *********************************************************************************/
 int mxp_tcb_identify(MXP_CMD_T*  msg)
 {
-  unsigned long irq_st;
-
-  local_irq_save(irq_st);
-
-  if ((msg->cp.task.tid = tcb_by_name(msg->cp.task.name)) == -1){
-    local_irq_restore(irq_st);
+  if ((msg->cp.task.tid = tcb_by_name(msg->cp.task.name)) == -1)
     return ERR_INVNAME;
-  }
 
-  local_irq_restore(irq_st);
   return ERR_NOERR;
 }
 
@@ -150,28 +300,55 @@ int mxp_tcb_identify(MXP_CMD_T*  msg)
 *********************************************************************************/
 int mxp_tcb_alloc(MXP_CMD_T*  msg)
 {
+  struct task_struct *p = current;
   int j;
   unsigned long irq_st;
 
-  local_irq_save(irq_st);
-
-  if (tcb_by_name(msg->cp.task.name) != -1){
-    local_irq_restore(irq_st);
+  /* the task is the calling thread unless the caller names another one */
+  if (msg->cp.task.pid && (msg->cp.task.pid != current->pid)){
+    rcu_read_lock();
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+    p = pid_task(find_vpid(msg->cp.task.pid), PIDTYPE_PID);
+#else
+    p = find_task_by_pid(msg->cp.task.pid);
+#endif
+    if (p)
+      get_task_struct(p);
+    rcu_read_unlock();
+    if (p == NULL)
+      return ERR_HOST_API;
+  } else
+    get_task_struct(p);
+
+  spin_lock_irqsave(&tcb_table_lock, irq_st);
+
+  if (nidx_Find(&tcb_names, msg->cp.task.name) != -1){
+    spin_unlock_irqrestore(&tcb_table_lock, irq_st);
+    put_task_struct(p);
     return ERR_ASGN;
   }
 
-  for (j = 1; j<MXP_TASK_MAX; j++){
-    if (mxp_tcb[j].busy == 0){
-      mxp_tcb[j].busy  = 1;
-      msg->cp.task.tid = j;
-      strcpy(mxp_tcb[j].name, msg->cp.task.name);
-      printk(KERN_ERR "tcb_alloc: task id=%d,name=%s,busy=%d\n",j,mxp_tcb[j].name,mxp_tcb[j].busy); 
-      local_irq_restore(irq_st);
-      return ERR_NOERR;
-    }
+  if ((j = idalloc_Get(&tcb_ids)) < 0){
+    spin_unlock_irqrestore(&tcb_table_lock, irq_st);
+    put_task_struct(p);
+    return ERR_NOTCB;
   }
-  local_irq_restore(irq_st);
-  return ERR_NOTCB;
+
+  spin_lock(&(mxp_subtcb[j].lock));
+  mxp_tcb[j].busy  = 1;
+  mxp_tcb[j].pid      = p->pid;
+  mxp_tcb[j].priority = msg->cp.task.prio;
+  mxp_subtcb[j].task  = p;
+  mxp_subtcb[j].spin_max    = 0;
+  mxp_subtcb[j].spin_win    = 0;
+  mxp_subtcb[j].spin_hits   = 0;
+  mxp_subtcb[j].spin_misses = 0;
+  spin_unlock(&(mxp_subtcb[j].lock));
+  msg->cp.task.tid = j;
+  strcpy(mxp_tcb[j].name, msg->cp.task.name);
+  nidx_Insert(&tcb_names, j);
+  spin_unlock_irqrestore(&tcb_table_lock, irq_st);
+  return ERR_NOERR;
 }
 
 /*********************************************************************************
@@ -181,22 +358,226 @@ int mxp_tcb_alloc(MXP_CMD_T*  msg)
 *********************************************************************************/
 int mxp_tcb_free(MXP_CMD_T*  msg)
 {
+  struct task_struct *p;
   unsigned long irq_st;
 
-  local_irq_save(irq_st);
+  if ((msg->cp.task.tid < 1) || (msg->cp.task.tid >= MXP_TASK_MAX))
+    return ERR_TIDINV;
+
+  spin_lock_irqsave(&tcb_table_lock, irq_st);
 
-  if ((msg->cp.task.tid < 1) ||
-      (msg->cp.task.tid >= MXP_TASK_MAX) ||
-      (mxp_tcb[msg->cp.task.tid].busy == 0))
+  if (mxp_tcb[msg->cp.task.tid].busy == 0)
   {
-    local_irq_restore(irq_st);
+    spin_unlock_irqrestore(&tcb_table_lock, irq_st);
     return ERR_TIDINV;
   }
 
+  nidx_Remove(&tcb_names, msg->cp.task.tid);
+  spin_lock(&(mxp_subtcb[msg->cp.task.tid].lock));
   mxp_tcb[msg->cp.task.tid].busy = 0;
-  printk(KERN_ERR "tcb_free: task id=%d, name=%s\n",msg->cp.task.tid,mxp_tcb[msg->cp.task.tid].name);
-  local_irq_restore(irq_st);
+  p = mxp_subtcb[msg->cp.task.tid].task;
+  mxp_subtcb[msg->cp.task.tid].task = NULL;
+  spin_unlock(&(mxp_subtcb[msg->cp.task.tid].lock));
+  spin_unlock_irqrestore(&tcb_table_lock, irq_st);
+
+  /* the tid is not busy any more but must not go back to the allocator before
+     the objects of the task are gone, a new task could get them otherwise */
+  lwt_freeTask(msg->cp.task.tid);
+  ring_free(msg->cp.task.tid);
+
+  spin_lock_irqsave(&tcb_table_lock, irq_st);
+  idalloc_Put(&tcb_ids, msg->cp.task.tid);
+  spin_unlock_irqrestore(&tcb_table_lock, irq_st);
+
+  if (p)
+    put_task_struct(p);
+
+  return ERR_NOERR;
+}
+
+/* run thread p with the scheduling policy MXP priority prio maps to.
+   check - the caller needs the right to do it (sched_setscheduler), else it is
+   done on behalf of MXP itself. May sleep, no MXP lock may be held. */
+static int tcb_applyPrio(struct task_struct *p, int prio, int check)
+{
+  struct sched_param sp;
+  int policy;
+  int err;
+
+  if (mxp_rt_prio && (prio >= mxp_rt_prio)){
+    policy = SCHED_FIFO;
+    sp.sched_priority = mxp_rt_base + (prio - mxp_rt_prio);
+    if (sp.sched_priority < 1)
+      sp.sched_priority = 1;
+    if (sp.sched_priority >= MAX_USER_RT_PRIO)
+      sp.sched_priority = MAX_USER_RT_PRIO - 1;
+  } else {
+    policy = SCHED_NORMAL;
+    sp.sched_priority = 0;
+  }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+  err = check ? sched_setscheduler(p, policy, &sp) : sched_setscheduler_nocheck(p, policy, &sp);
+#else
+  /* no unchecked variant: MXP acts with the rights of the calling thread */
+  err = sched_setscheduler(p, policy, &sp);
+#endif
+  if (err)
+    printk(KERN_INFO "mxp: pid %d policy %d failed (%d)\n", p->pid, policy, err);
+
+  return err;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_task_setprio
+*
+* DESCRIPTION: change the MXP priority of a task and move its thread to the
+*              scheduling policy the priority maps to
+*********************************************************************************/
+int mxp_task_setprio(MXP_CMD_T*  msg)
+{
+  struct task_struct *p;
+  int tid = msg->cp.prio.tid;
+
+  if ((p = tcb_task(tid)) == NULL)
+    return ERR_TIDINV;
+
+  if (tcb_applyPrio(p, msg->cp.prio.prio, 1)){
+    put_task_struct(p);
+    return ERR_HOST_API;
+  }
+
+  mxp_tcb[tid].priority = msg->cp.prio.prio;
+  msg->cp.prio.policy   = p->policy;
+  msg->cp.prio.rt_prio  = p->rt_priority;
+  put_task_struct(p);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_task_getprio
+*
+* DESCRIPTION: get the MXP priority of a task and the scheduling policy its
+*              thread actually runs with
+*********************************************************************************/
+int mxp_task_getprio(MXP_CMD_T*  msg)
+{
+  struct task_struct *p;
+  int tid = msg->cp.prio.tid;
+
+  if ((p = tcb_task(tid)) == NULL)
+    return ERR_TIDINV;
+
+  msg->cp.prio.prio    = mxp_tcb[tid].priority;
+  msg->cp.prio.policy  = p->policy;
+  msg->cp.prio.rt_prio = p->rt_priority;
+  put_task_struct(p);
+  return ERR_NOERR;
+}
+
+/* CPUs thread p may run on, bit N for CPU N */
+static unsigned long tcb_cpuMask(struct task_struct *p)
+{
+  unsigned long bits = 0;
+  int cpu;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+  for (cpu = 0; (cpu < nr_cpu_ids) && (cpu < BITS_PER_LONG); cpu++)
+    if (cpumask_test_cpu(cpu, &(p->cpus_allowed)))
+      bits |= 1UL << cpu;
+#else
+  for (cpu = 0; (cpu < NR_CPUS) && (cpu < BITS_PER_LONG); cpu++)
+    if (cpu_isset(cpu, p->cpus_allowed))
+      bits |= 1UL << cpu;
+#endif
+  return bits;
+}
+
+/* let thread p run on the CPUs set in bits, fails if none of them is online */
+static int tcb_setCpuMask(struct task_struct *p, unsigned long bits)
+{
+  cpumask_t mask;
+  int cpu;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+  cpumask_clear(&mask);
+  for (cpu = 0; (cpu < nr_cpu_ids) && (cpu < BITS_PER_LONG); cpu++)
+    if (bits & (1UL << cpu))
+      cpumask_set_cpu(cpu, &mask);
+  return set_cpus_allowed_ptr(p, &mask);
+#else
+  cpus_clear(mask);
+  for (cpu = 0; (cpu < NR_CPUS) && (cpu < BITS_PER_LONG); cpu++)
+    if (bits & (1UL << cpu))
+      cpu_set(cpu, mask);
+  return set_cpus_allowed(p, mask);
+#endif
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_task_affinity
+*
+* DESCRIPTION: set the CPUs the thread of a task may run on and get them
+*********************************************************************************/
+int mxp_task_affinity(MXP_CMD_T*  msg)
+{
+  struct task_struct *p;
+  int err;
+
+  if ((p = tcb_task(msg->cp.aff.tid)) == NULL)
+    return ERR_TIDINV;
+
+  if (msg->cp.aff.mask){
+    if ((err = tcb_setCpuMask(p, msg->cp.aff.mask)) != 0){
+      put_task_struct(p);
+      printk(KERN_INFO "mxp_task_affinity: task %d mask %lx failed (%d)\n",
+             msg->cp.aff.tid, msg->cp.aff.mask, err);
+      return ERR_HOST_API;
+    }
+  }
+
+  msg->cp.aff.mask = tcb_cpuMask(p);
+  msg->cp.aff.cpu  = task_cpu(p);
+
+  put_task_struct(p);
+  return ERR_NOERR;
+}
+
+/*********************************************************************************
+* FUNCTION: mxp_task_spin
+*
+* DESCRIPTION: set the spin limit of a task and get its spin counters
+*********************************************************************************/
+int mxp_task_spin(MXP_CMD_T*  msg)
+{
+  unsigned long irq_st;
+  unsigned int limit = msg->cp.spin.limit;
+  int tid = msg->cp.spin.tid;
+
+#ifndef CONFIG_SMP
+  if (limit && (limit != MXP_TASK_SPIN_KEEP))
+    return SYS_NO_SUPPORT;
+#endif
+
+  if (!tcb_lock(tid, &irq_st))
+    return ERR_TIDINV;
+
+  if (limit != MXP_TASK_SPIN_KEEP){
+    if (limit > MXP_TASK_SPIN_MAX)
+      limit = MXP_TASK_SPIN_MAX;
+    mxp_subtcb[tid].spin_max    = limit;
+    mxp_subtcb[tid].spin_gap    = limit / 2;
+    mxp_subtcb[tid].spin_win    = limit;
+    mxp_subtcb[tid].spin_hits   = 0;
+    mxp_subtcb[tid].spin_misses = 0;
+  }
+
+  msg->cp.spin.limit  = mxp_subtcb[tid].spin_max;
+  msg->cp.spin.window = mxp_subtcb[tid].spin_win;
+  msg->cp.spin.hits   = mxp_subtcb[tid].spin_hits;
+  msg->cp.spin.misses = mxp_subtcb[tid].spin_misses;
 
+  TCB_UNLOCK(tid, irq_st);
   return ERR_NOERR;
 }
 
@@ -223,11 +604,11 @@ int mxp_task_sleep(MXP_CMD_T*  msg){
   int tid = msg->cp.task_cmd.tid;
   int ret;
 
-  local_irq_save(irq_st);
+  spin_lock_irqsave(&tmr_base_lock, irq_st);
   /*  start timer object */
   tmrobj_Start(&(mxp_subtcb[tid].tmrobj), msg->cp.task_cmd.timeout,
                                   mxp_task_wakeup, (void*)tid);
-  local_irq_restore(irq_st);
+  spin_unlock_irqrestore(&tmr_base_lock, irq_st);
   /*  and put the task to sleep */
   ret = wait_event_interruptible( (mxp_subtcb[tid].gate_lock), (mxp_subtcb[tid].tmrobj.wait4event == 0));
   
@@ -236,14 +617,16 @@ int mxp_task_sleep(MXP_CMD_T*  msg){
 
   /* if task woke up because kill signal we have to delete timer object
      otherwise it is already deleted by timer manager */
-  local_irq_save(irq_st);
+  spin_lock_irqsave(&tmr_base_lock, irq_st);
 
   /* after waking up we have to decide whether it was caused by wakeup or
      other unexpected signal */
   if ( ret == -ERESTARTSYS ){
     /* it was unexpected signal */
     mxp_subtcb[tid].tmrobj.wait4event       = 0;
-    spin_unlock_irqrestore(&mxp_lock, irq_st);
+    if (mxp_subtcb[tid].tmrobj._index > 0)
+      tmrobj_Delete(&(mxp_subtcb[tid].tmrobj));
+    spin_unlock_irqrestore(&tmr_base_lock, irq_st);
     printk( KERN_INFO "mxp_task_sleep for task %d waken up by unexpected signal\n", tid);
     return SYS_CONFIG_ERR;
   }
@@ -253,7 +636,7 @@ int mxp_task_sleep(MXP_CMD_T*  msg){
     /* TODO: may be we have to return an error here */
   }
 
-  local_irq_restore(irq_st);
+  spin_unlock_irqrestore(&tmr_base_lock, irq_st);
   return ERR_NOERR;
 }
 /*********************************************************************/
@@ -266,6 +649,31 @@ int mxp_task_sleep(MXP_CMD_T*  msg){
 /*********************************************************************/
 #include "mmxp_q.c"
 
+/*********************************************************************/
+/********** SORTED QUEUES IMPLEMENTATION *****************************/
+/*********************************************************************/
+#include "mmxp_sq.c"
+
+/*********************************************************************/
+/********** FAN-OUT IMPLEMENTATION ***********************************/
+/*********************************************************************/
+#include "mmxp_fan.c"
+
+/*********************************************************************/
+/********** SEMAPHORES IMPLEMENTATION ********************************/
+/*********************************************************************/
+#include "mmxp_sem.c"
+
+/*********************************************************************/
+/********** MUTEXES IMPLEMENTATION ***********************************/
+/*********************************************************************/
+#include "mmxp_mtx.c"
+
+/*********************************************************************/
+/********** LIGHTWEIGHT THREADS IMPLEMENTATION ***********************/
+/*********************************************************************/
+#include "mmxp_lwt.c"
+
 /*********************************************************************/
 /********** TIMERS IMPLEMENTATION ************************************/
 /*********************************************************************/
@@ -286,18 +694,35 @@ typedef struct mxl_timer_t {
     unsigned long       postEvent;
     int                 queueId;
     void*               pMsg;
+    int                 oneshot;  /* armed by mxp_tmr_arm, freed when it fires */
+    unsigned int        gen;      /* bumped on every mxp_tmr_arm of the block */
     TMROBJ_T            tmrobj;
 } MXL_TIMER_T;
 
+/* handle of a one-shot kernel timer: block index and generation, so a stale
+   handle can not cancel the next user of the same block */
+#define TMR_HANDLE(id, gen)  (((gen) << 16) | (id))
+#define TMR_HANDLE_ID(h)     ((h) & 0xffff)
+#define TMR_HANDLE_GEN(h)    (((unsigned int)(h)) >> 16)
+
 /* array of timers */
 static MXL_TIMER_T timers[MAX_TIMERS];
 
+/* timer ID allocator */
+static MXP_ID_ALLOC_T tmr_ids;
+static DECLARE_BITMAP(tmr_ids_map, MAX_TIMERS);
+static short          tmr_ids_stack[MAX_TIMERS];
+
 /*********************************************************************************
 * FUNCTION: mxl_tmr_init
 *
 * DESCRIPTION:
 *********************************************************************************/
-void mxl_tmr_init(void){ memset(timers, 0, sizeof(timers)); }
+void mxl_tmr_init(void)
+{
+  memset(timers, 0, sizeof(timers));
+  idalloc_Init(&tmr_ids, tmr_ids_map, tmr_ids_stack, MAX_TIMERS, 0);
+}
 
 /*********************************************************************************
 * FUNCTION: mxl_tmr_alloc
@@ -308,13 +733,10 @@ static int mxl_tmr_alloc(void)
 {
     int j;
 
-    for (j=0; j<MAX_TIMERS; j++){
-        if (timers[j].state == TMR_FREE){
-            return j;
-        }
-    }
+    if ((j = idalloc_Get(&tmr_ids)) < 0)
+        return 99999;
 
-    return 99999;
+    return j;
 }
 /*********************************************************************************
 * FUNCTION: mxp_tmrCreate
@@ -326,15 +748,16 @@ static int mxp_tmrCreate( MXP_CMD_T*  msg)
   unsigned long irq_st;
   int tmr_id;
 
-  local_irq_save(irq_st);
+  spin_lock_irqsave(&tmr_base_lock, irq_st);
 
   /* allocate a control block */
   if ((tmr_id = mxl_tmr_alloc()) == 99999){
-    local_irq_restore(irq_st);
+    spin_unlock_irqrestore(&tmr_base_lock, irq_st);
     return ERR_NOTMR;
   }
 
   timers[tmr_id].state     = TMR_IDLE;
+  timers[tmr_id].oneshot   = 0;
   timers[tmr_id].queueId   = msg->cp.tmr.qid;
   timers[tmr_id].pMsg      = msg->cp.tmr.msg;
   timers[tmr_id].taskId    = msg->cp.tmr.tsk_id;
@@ -342,22 +765,34 @@ static int mxp_tmrCreate( MXP_CMD_T*  msg)
 
   msg->cp.tmr.tmr_id = tmr_id;
 
-  local_irq_restore(irq_st);
+  spin_unlock_irqrestore(&tmr_base_lock, irq_st);
   return ERR_NOERR;
 }
 
 /*********************************************************************************
 * FUNCTION: mxp_timerTimeOut
 *
-* DESCRIPTION: timer expiration handler
+* DESCRIPTION: timer expiration handler. tmrobj_clock calls it without the lock
+*              once the timer object is off the heap, so the timer may have been
+*              aborted, deleted or started again in between: the expiry only
+*              counts if the timer is still active and not back on the heap.
 *********************************************************************************/
 static void mxp_timerTimeOut(struct TMROBJ_tag *this){
   unsigned long irq_st;
   MXP_CMD_T    msg;
   MXL_TIMER_T *timer = (MXL_TIMER_T*)(this->owner);
 
-  local_irq_save(irq_st);
-  if (timer->reloadPeriod != MX_INDEFINITE && timer->reloadPeriod != 0)
+  spin_lock_irqsave(&tmr_base_lock, irq_st);
+  if ((timer->state != TMR_ACTIVE) || (this->_index != 0)){
+    spin_unlock_irqrestore(&tmr_base_lock, irq_st);
+    return;
+  }
+
+  if (timer->oneshot){
+    timer->state = TMR_FREE;
+    idalloc_Put(&tmr_ids, timer - timers);
+  }
+  else if (timer->reloadPeriod != MX_INDEFINITE && timer->reloadPeriod != 0)
     tmrobj_Start(&(timer->tmrobj), timer->reloadPeriod, mxp_timerTimeOut, timer);
   else
     timer->state = TMR_FIRED;
@@ -365,13 +800,17 @@ static void mxp_timerTimeOut(struct TMROBJ_tag *this){
   if (timer->postEvent){
     msg.cp.ev.tid       = timer->taskId;
     msg.cp.ev.events    = timer->postEvent;
-    local_irq_restore(irq_st);
+    spin_unlock_irqrestore(&tmr_base_lock, irq_st);
     mxp_ev_post( &msg);
   } else {
     msg.cp.q.qid        = timer->queueId;
     msg.cp.q.msg_ptr    = timer->pMsg;
-    local_irq_restore(irq_st);
-    mxp_q_post( &msg);
+    msg.cp.q.prio       = 0;
+    msg.cp.q.flags      = 0;
+    msg.cp.q.key        = timer - timers; /* conflating queues keep one per timer */
+    msg.cp.q.expire     = 0;
+    spin_unlock_irqrestore(&tmr_base_lock, irq_st);
+    mxp_q_post_ex( &msg, Q_SRC_VALUE);
   }
 }
 
@@ -385,11 +824,11 @@ int mxp_tmrStart(MXP_CMD_T*  msg )
   unsigned long irq_st;
   int tmr_id;
 
-  local_irq_save(irq_st);
+  spin_lock_irqsave(&tmr_base_lock, irq_st);
 
   tmr_id = msg->cp.tmr.tmr_id;
-  if ((tmr_id >=MAX_TIMERS)||(timers[tmr_id].state == TMR_FREE)){
-    local_irq_restore(irq_st);
+  if ((tmr_id >=MAX_TIMERS)||(timers[tmr_id].state == TMR_FREE)||timers[tmr_id].oneshot){
+    spin_unlock_irqrestore(&tmr_base_lock, irq_st);
     return ERR_TMRINV;
   }
   timers[tmr_id].reloadPeriod = msg->cp.tmr.reload;
@@ -398,7 +837,7 @@ int mxp_tmrStart(MXP_CMD_T*  msg )
   tmrobj_Start(&(timers[tmr_id].tmrobj), msg->cp.tmr.timeout,
                       mxp_timerTimeOut, &timers[tmr_id]);
 
-  local_irq_restore(irq_st);
+  spin_unlock_irqrestore(&tmr_base_lock, irq_st);
   return ERR_NOERR;
 }
 
@@ -413,11 +852,11 @@ int mxp_tmrAbort(MXP_CMD_T*  msg)
   int          tmr_id;
   int          ret = ERR_NOERR;
 
-  local_irq_save(irq_st);
+  spin_lock_irqsave(&tmr_base_lock, irq_st);
 
   tmr_id = msg->cp.tmr.tmr_id;
-  if ((tmr_id >=MAX_TIMERS)||(timers[tmr_id].state == TMR_FREE)){
-    local_irq_restore(irq_st);
+  if ((tmr_id >=MAX_TIMERS)||(timers[tmr_id].state == TMR_FREE)||timers[tmr_id].oneshot){
+    spin_unlock_irqrestore(&tmr_base_lock, irq_st);
     return ERR_TMRINV;
   }
   if (timers[tmr_id].state == TMR_ACTIVE)
@@ -427,7 +866,7 @@ int mxp_tmrAbort(MXP_CMD_T*  msg)
   else if (timers[tmr_id].state == TMR_IDLE)   ret = ERR_TMRIDLE;
 
   timers[tmr_id].state = TMR_IDLE;
-  local_irq_restore(irq_st);
+  spin_unlock_irqrestore(&tmr_base_lock, irq_st);
 
   return ret;
 }
@@ -443,11 +882,11 @@ int mxp_tmrDelete(MXP_CMD_T*  msg)
   int          tmr_id;
   int          ret = ERR_NOERR;
 
-  local_irq_save(irq_st);
+  spin_lock_irqsave(&tmr_base_lock, irq_st);
 
   tmr_id = msg->cp.tmr.tmr_id;
-  if ((tmr_id >=MAX_TIMERS)||(timers[tmr_id].state == TMR_FREE)){
-    local_irq_restore(irq_st);
+  if ((tmr_id >=MAX_TIMERS)||(timers[tmr_id].state == TMR_FREE)||timers[tmr_id].oneshot){
+    spin_unlock_irqrestore(&tmr_base_lock, irq_st);
     return ERR_TMRINV;
   }
 
@@ -455,11 +894,86 @@ int mxp_tmrDelete(MXP_CMD_T*  msg)
       tmrobj_Delete(&(timers[tmr_id].tmrobj));
 
   timers[tmr_id].state = TMR_FREE;
-  local_irq_restore(irq_st);
+  idalloc_Put(&tmr_ids, tmr_id);
+  spin_unlock_irqrestore(&tmr_base_lock, irq_st);
 
   return ret;
 }
 
+/*********************************************************************************
+* FUNCTION: mxp_tmr_arm
+*
+* DESCRIPTION: arm a one-shot timer for another kernel driver, callable from
+*              softirq context. When it fires after timeout ticks it posts events
+*              to task tid if events is not 0, else it posts msg to queue qid.
+*              The timer block is released when it fires or is cancelled.
+*********************************************************************************/
+int mxp_tmr_arm(int *handle, unsigned long timeout, int qid, void *msg,
+                int tid, unsigned long events)
+{
+  unsigned long irq_st;
+  int tmr_id;
+
+  if ((handle == NULL) || (timeout == 0))
+    return ERR_NULLPTR;
+
+  spin_lock_irqsave(&tmr_base_lock, irq_st);
+
+  if ((tmr_id = mxl_tmr_alloc()) == 99999){
+    spin_unlock_irqrestore(&tmr_base_lock, irq_st);
+    return ERR_NOTMR;
+  }
+
+  timers[tmr_id].state        = TMR_ACTIVE;
+  timers[tmr_id].oneshot      = 1;
+  timers[tmr_id].gen          = (timers[tmr_id].gen + 1) & 0x7fff;
+  timers[tmr_id].reloadPeriod = 0;
+  timers[tmr_id].queueId      = qid;
+  timers[tmr_id].pMsg         = msg;
+  timers[tmr_id].taskId       = tid;
+  timers[tmr_id].postEvent    = events;
+
+  tmrobj_Start(&(timers[tmr_id].tmrobj), timeout, mxp_timerTimeOut, &timers[tmr_id]);
+  *handle = TMR_HANDLE(tmr_id, timers[tmr_id].gen);
+
+  spin_unlock_irqrestore(&tmr_base_lock, irq_st);
+  return ERR_NOERR;
+}
+EXPORT_SYMBOL(mxp_tmr_arm);
+
+/*********************************************************************************
+* FUNCTION: mxp_tmr_cancel
+*
+* DESCRIPTION: cancel a timer armed by mxp_tmr_arm, returns ERR_TMREXP if it has
+*              already fired or is firing; the expiry handler frees it then
+*********************************************************************************/
+int mxp_tmr_cancel(int handle)
+{
+  unsigned long irq_st;
+  int tmr_id = TMR_HANDLE_ID(handle);
+
+  if ((handle < 0) || (tmr_id >= MAX_TIMERS))
+    return ERR_TMRINV;
+
+  spin_lock_irqsave(&tmr_base_lock, irq_st);
+
+  /* off the heap but still active: the expiry handler is about to run */
+  if ((timers[tmr_id].state != TMR_ACTIVE) || !timers[tmr_id].oneshot ||
+      (timers[tmr_id].gen != TMR_HANDLE_GEN(handle)) ||
+      (timers[tmr_id].tmrobj._index == 0)){
+    spin_unlock_irqrestore(&tmr_base_lock, irq_st);
+    return ERR_TMREXP;
+  }
+
+  tmrobj_Delete(&(timers[tmr_id].tmrobj));
+  timers[tmr_id].state = TMR_FREE;
+  idalloc_Put(&tmr_ids, tmr_id);
+
+  spin_unlock_irqrestore(&tmr_base_lock, irq_st);
+  return ERR_NOERR;
+}
+EXPORT_SYMBOL(mxp_tmr_cancel);
+
 /*********************************************************************************
 * FUNCTION: mxp_getTicks
 *
@@ -470,6 +984,168 @@ static int mxp_getTicks(MXP_CMD_T*  msg){
     return ERR_NOERR;
 }
 
+/*********************************************************************/
+/********** COMMAND RINGS IMPLEMENTATION *****************************/
+/*********************************************************************/
+#include "mmxp_ring.c"
+
+/* offset of the first output field of every compact ioctl that has output,
+   everything from there to the end of its struct is copied back */
+#define V2_NR(cmd)  (_IOC_NR(cmd) - MXPCORE_DEV_IOC_V2BASE)
+static const unsigned char mxp_v2_out[MXPCORE_DEV_IOC_V2MAXNR - MXPCORE_DEV_IOC_V2BASE + 1] = {
+  [V2_NR(MXP_V2_EVENT_WAIT)]  = offsetof(MXP_EV_WAIT_V2_T, events),
+  [V2_NR(MXP_V2_QUEUE_POST)]  = offsetof(MXP_Q_POST_V2_T, replaced),
+  [V2_NR(MXP_V2_QUEUE_WAIT)]  = offsetof(MXP_Q_WAIT_V2_T, msg_ptr),
+  [V2_NR(MXP_V2_TMR_GETTICK)] = 0,
+};
+
+/*********************************************************************************
+* FUNCTION: mxp_ioctl_v2
+*
+* DESCRIPTION: the compact ioctls, only the parameter struct of the command is
+*              copied in and only its output fields are copied back; the
+*              command runs by the same function as its MXP_CMD_T ioctl
+*********************************************************************************/
+static long mxp_ioctl_v2(unsigned int ioctl_num, unsigned long ioctl_param)
+{
+    union {
+        MXP_EV_POST_V2_T    evp;
+        MXP_EV_WAIT_V2_T    evw;
+        MXP_Q_POST_V2_T     qp;
+        MXP_Q_WAIT_V2_T     qw;
+        MXP_TMR_START_V2_T  tmr;
+        MXP_TASK_SLEEP_V2_T slp;
+        MXP_SEM_V2_T        sem;
+        MXP_MTX_V2_T        mtx;
+        MXP_LWT_POST_V2_T   lwt;
+        int                 id;
+        unsigned long       tick;
+    } p;
+    MXP_CMD_T  cmd; /* only the fields the command reads are set */
+    unsigned int size = _IOC_SIZE(ioctl_num);
+    unsigned int out;
+    int res;
+
+    if (unlikely(size > sizeof(p)))
+        return -ENOTTY;
+
+    if ((_IOC_DIR(ioctl_num) & _IOC_WRITE) &&
+        unlikely(copy_from_user(&p, (void __user *) ioctl_param, size)))
+        return -EFAULT;
+
+    switch (ioctl_num)
+    {
+      case MXP_V2_EVENT_POST:
+        cmd.cp.ev.tid       = p.evp.tid;
+        cmd.cp.ev.events    = p.evp.events;
+        res = mxp_ev_post(&cmd);
+        break;
+
+      case MXP_V2_EVENT_WAIT:
+        cmd.cp.ev.tid       = p.evw.tid;
+        cmd.cp.ev.events    = p.evw.mask;
+        cmd.cp.ev.condition = p.evw.condition;
+        cmd.cp.ev.timeout   = p.evw.timeout;
+        res = mxp_ev_wait(&cmd);
+        p.evw.events        = cmd.cp.ev.events;
+        break;
+
+      case MXP_V2_QUEUE_POST:
+        cmd.cp.q.qid        = p.qp.qid;
+        cmd.cp.q.prio       = p.qp.prio;
+        cmd.cp.q.flags      = p.qp.flags;
+        cmd.cp.q.key        = p.qp.key;
+        cmd.cp.q.msgsize    = p.qp.msgsize;
+        cmd.cp.q.expire     = p.qp.expire;
+        cmd.cp.q.msg_ptr    = p.qp.msg_ptr;
+        res = mxp_q_post(&cmd);
+        if (res != ERR_NOERR)
+            return res; /* replaced is not written */
+        /* a conflating queue returns the message the post replaced in msg_ptr
+           (NULL if none), any other queue leaves msg_ptr alone; a message
+           replaced by itself stays queued and is not returned either */
+        p.qp.replaced       = (cmd.cp.q.msg_ptr != p.qp.msg_ptr) ? cmd.cp.q.msg_ptr : NULL;
+        break;
+
+      case MXP_V2_QUEUE_WAIT:
+        cmd.cp.q.qid        = p.qw.qid;
+        cmd.cp.q.timeout    = p.qw.timeout;
+        cmd.cp.q.msg_ptr    = p.qw.buf;
+        cmd.cp.q.msgsize    = p.qw.bufsize;
+        cmd.cp.q.prio       = 0;
+        res = mxp_q_wait(&cmd);
+        p.qw.msg_ptr        = cmd.cp.q.msg_ptr;
+        p.qw.prio           = cmd.cp.q.prio;
+        p.qw.msgsize        = cmd.cp.q.msgsize;
+        break;
+
+      case MXP_V2_TMR_START:
+        cmd.cp.tmr.tmr_id   = p.tmr.tmr_id;
+        cmd.cp.tmr.timeout  = p.tmr.timeout;
+        cmd.cp.tmr.reload   = p.tmr.reload;
+        res = mxp_tmrStart(&cmd);
+        break;
+
+      case MXP_V2_TMR_ABORT:
+        cmd.cp.tmr.tmr_id   = p.id;
+        res = mxp_tmrAbort(&cmd);
+        break;
+
+      case MXP_V2_TMR_GETTICK:
+        p.tick = mxp_tick;
+        res = ERR_NOERR;
+        break;
+
+      case MXP_V2_TASK_SLEEP:
+        cmd.cp.task_cmd.tid     = p.slp.tid;
+        cmd.cp.task_cmd.timeout = p.slp.timeout;
+        res = mxp_task_sleep(&cmd);
+        break;
+
+      case MXP_V2_SEM_WAIT:
+        cmd.cp.sem.sid      = p.sem.sid;
+        cmd.cp.sem.timeout  = p.sem.timeout;
+        res = mxp_sem_wait(&cmd);
+        break;
+
+      case MXP_V2_SEM_POST:
+        cmd.cp.sem.sid      = p.sem.sid;
+        cmd.cp.sem.count    = p.sem.count;
+        res = mxp_sem_post(&cmd);
+        break;
+
+      case MXP_V2_MUTEX_LOCK:
+        cmd.cp.mtx.mid      = p.mtx.mid;
+        cmd.cp.mtx.tid      = p.mtx.tid;
+        cmd.cp.mtx.timeout  = p.mtx.timeout;
+        res = mxp_mtx_lock(&cmd);
+        break;
+
+      case MXP_V2_MUTEX_UNLOCK:
+        cmd.cp.mtx.mid      = p.mtx.mid;
+        cmd.cp.mtx.tid      = p.mtx.tid;
+        res = mxp_mtx_unlock(&cmd);
+        break;
+
+      case MXP_V2_LWT_POST:
+        cmd.cp.lwt.lwid     = p.lwt.lwid;
+        cmd.cp.lwt.events   = p.lwt.events;
+        res = mxp_lwt_post(&cmd);
+        break;
+
+      default:
+        return -ENOTTY;
+    }
+
+    if (_IOC_DIR(ioctl_num) & _IOC_READ){
+        out = mxp_v2_out[V2_NR(ioctl_num)];
+        if (unlikely(copy_to_user((char __user *) ioctl_param + out, (char *) &p + out, size - out)))
+            return -EFAULT;
+    }
+
+    return res;
+}
+
 /*********************************************************************************
 * FUNCTION: mxp_ioctl
 *
@@ -480,17 +1156,26 @@ static long  mxp_ioctl(struct file *file,
                 unsigned long ioctl_param)
 {
     MXP_CMD_T  msg;
+    unsigned int size = _IOC_SIZE(ioctl_num);
     int res;
 
+    if (likely((_IOC_TYPE(ioctl_num) == MXPCORE_IOCTL_MAGIC)
+               && (_IOC_NR(ioctl_num) >= MXPCORE_DEV_IOC_V2BASE)
+               && (_IOC_NR(ioctl_num) <= MXPCORE_DEV_IOC_V2MAXNR)))
+        return mxp_ioctl_v2(ioctl_num, ioctl_param);
+
+    /* the original codes pass MXP_CMD_V1_T, the later ones MXP_CMD_T; only the
+       size the code was built with is copied */
     if (unlikely((_IOC_TYPE(ioctl_num) != MXPCORE_IOCTL_MAGIC) 
-                || (_IOC_NR(ioctl_num) > MXPCORE_DEV_IOC_MAXNR)))
+                || (_IOC_NR(ioctl_num) > MXPCORE_DEV_IOC_MAXNR)
+                || ((size != sizeof(MXP_CMD_V1_T)) && (size != sizeof(MXP_CMD_T)))))
     {
         res = -ENOTTY;
         goto error_label;
     }
 
-    if (unlikely((!access_ok(VERIFY_WRITE, (void __user *) ioctl_param, sizeof(MXP_CMD_T) ))
-                ||(__copy_from_user((void *)&msg, (void __user *) ioctl_param, (unsigned long) sizeof(MXP_CMD_T)))))
+    if (unlikely((!access_ok(VERIFY_WRITE, (void __user *) ioctl_param, size))
+                ||(__copy_from_user((void *)&msg, (void __user *) ioctl_param, (unsigned long) size))))
     {
         res = -EFAULT;
         goto error_label;
@@ -498,8 +1183,10 @@ static long  mxp_ioctl(struct file *file,
 
     switch (ioctl_num) 
     {
-      case MXP_QUEUE_POST:   {res = mxp_q_post(&msg); break;}
-      case MXP_QUEUE_WAIT:   {res = mxp_q_wait(&msg); break;}
+      case MXP_QUEUE_POST:   {q_v1Defaults(&msg); res = mxp_q_post(&msg); break;}
+      case MXP_QUEUE_WAIT:   {q_v1Defaults(&msg); res = mxp_q_wait(&msg); break;}
+      case MXP_QUEUE_POST_EX:{res = mxp_q_post(&msg); break;}
+      case MXP_QUEUE_WAIT_EX:{res = mxp_q_wait(&msg); break;}
 
       case MXP_EVENT_POST:   {res = mxp_ev_post(&msg); break;}
       case MXP_EVENT_WAIT:   {res = mxp_ev_wait(&msg); break;}
@@ -507,11 +1194,62 @@ static long  mxp_ioctl(struct file *file,
       case MXP_EVENT_CLEAR:  {res = mxp_ev_clear(&msg); break;}
       case MXP_EVENT_INQUIRY:{res = mxp_ev_inquiry(&msg); break;}
 
-      case MXP_QUEUE_CREATE: {res = mxp_q_create(&msg); break;}
+      case MXP_QUEUE_CREATE: {q_v1Defaults(&msg); res = mxp_q_create(&msg); break;}
+      case MXP_QUEUE_CREATE_EX:{res = mxp_q_create(&msg); break;}
       case MXP_QUEUE_DELETE: {res = mxp_q_delete(&msg); break;}
       case MXP_QUEUE_IDENTIFY:{res = mxp_q_identify(&msg); break;}
       case MXP_QUEUE_INQUIRY:{res = mxp_q_inquiry(&msg); break;}
       case MXP_QUEUE_DELALL: {res = mxp_q_delete_all(); break;}
+      case MXP_QUEUE_LVL_INQUIRY:{res = mxp_q_lvl_inquiry(&msg); break;}
+      case MXP_QUEUE_PEEK:   {res = mxp_q_peek(&msg); break;}
+      case MXP_QUEUE_WAIT_ANY:{res = mxp_q_wait_any(&msg); break;}
+      case MXP_QUEUE_STATS:  {res = mxp_q_stats(&msg); break;}
+      case MXP_QUEUE_RECLAIM:{res = mxp_q_reclaim(&msg); break;}
+
+      case MXP_SQUEUE_CREATE:  {res = mxp_sq_create(&msg); break;}
+      case MXP_SQUEUE_DELETE:  {res = mxp_sq_delete(&msg); break;}
+      case MXP_SQUEUE_IDENTIFY:{res = mxp_sq_identify(&msg); break;}
+      case MXP_SQUEUE_POST:    {res = mxp_sq_post(&msg); break;}
+      case MXP_SQUEUE_WAIT:    {res = mxp_sq_wait(&msg); break;}
+      case MXP_SQUEUE_PEEK:    {res = mxp_sq_peek(&msg); break;}
+      case MXP_SQUEUE_INQUIRY: {res = mxp_sq_inquiry(&msg); break;}
+
+      case MXP_FANOUT_CREATE:  {res = mxp_fan_create(&msg); break;}
+      case MXP_FANOUT_DELETE:  {res = mxp_fan_delete(&msg); break;}
+      case MXP_FANOUT_IDENTIFY:{res = mxp_fan_identify(&msg); break;}
+      case MXP_FANOUT_SUBSCRIBE:  {res = mxp_fan_subscribe(&msg); break;}
+      case MXP_FANOUT_UNSUBSCRIBE:{res = mxp_fan_unsubscribe(&msg); break;}
+      case MXP_FANOUT_POST:    {res = mxp_fan_post(&msg); break;}
+      case MXP_FANOUT_RELEASE: {res = mxp_fan_release(&msg); break;}
+      case MXP_FANOUT_RECLAIM: {res = mxp_fan_reclaim(&msg); break;}
+      case MXP_FANOUT_INQUIRY: {res = mxp_fan_inquiry(&msg); break;}
+
+      case MXP_SEM_CREATE:   {res = mxp_sem_create(&msg); break;}
+      case MXP_SEM_DELETE:   {res = mxp_sem_delete(&msg); break;}
+      case MXP_SEM_IDENTIFY: {res = mxp_sem_identify(&msg); break;}
+      case MXP_SEM_WAIT:     {res = mxp_sem_wait(&msg); break;}
+      case MXP_SEM_POST:     {res = mxp_sem_post(&msg); break;}
+      case MXP_SEM_INQUIRY:  {res = mxp_sem_inquiry(&msg); break;}
+
+      case MXP_MUTEX_CREATE:   {res = mxp_mtx_create(&msg); break;}
+      case MXP_MUTEX_DELETE:   {res = mxp_mtx_delete(&msg); break;}
+      case MXP_MUTEX_IDENTIFY: {res = mxp_mtx_identify(&msg); break;}
+      case MXP_MUTEX_LOCK:     {res = mxp_mtx_lock(&msg); break;}
+      case MXP_MUTEX_UNLOCK:   {res = mxp_mtx_unlock(&msg); break;}
+      case MXP_MUTEX_TRYLOCK:  {res = mxp_mtx_trylock(&msg); break;}
+
+      case MXP_LWT_CREATE:     {res = mxp_lwt_create(&msg); break;}
+      case MXP_LWT_DELETE:     {res = mxp_lwt_delete(&msg); break;}
+      case MXP_LWT_SETMASK:    {res = mxp_lwt_setmask(&msg); break;}
+      case MXP_LWT_SLEEP:      {res = mxp_lwt_sleep(&msg); break;}
+      case MXP_LWT_POST:       {res = mxp_lwt_post(&msg); break;}
+      case MXP_LWT_RUN:        {res = mxp_lwt_run(&msg); break;}
+      case MXP_LWT_INQUIRY:    {res = mxp_lwt_inquiry(&msg); break;}
+
+      case MXP_RING_SETUP:   {res = mxp_ring_setup(&msg); break;}
+      case MXP_RING_FREE:    {res = mxp_ring_free(&msg); break;}
+      case MXP_RING_ENTER:   {res = mxp_ring_enter(&msg); break;}
+
       case MXP_TMR_CREATE:   {res = mxp_tmrCreate(&msg); break;}
       case MXP_TMR_START:    {res = mxp_tmrStart(&msg); break;}
       case MXP_TMR_ABORT:    {res = mxp_tmrAbort(&msg); break;}
@@ -522,11 +1260,15 @@ static long  mxp_ioctl(struct file *file,
       case MXP_TASK_IDENTIFY:{res = mxp_tcb_identify(&msg); break;}
       case MXP_TASK_FREE:    {res = mxp_tcb_free(&msg); break;}
       case MXP_TASK_SLEEP:   {res = mxp_task_sleep(&msg); break;}
+      case MXP_TASK_SPIN:    {res = mxp_task_spin(&msg); break;}
+      case MXP_TASK_SETPRIO: {res = mxp_task_setprio(&msg); break;}
+      case MXP_TASK_GETPRIO: {res = mxp_task_getprio(&msg); break;}
+      case MXP_TASK_AFFINITY:{res = mxp_task_affinity(&msg); break;}
 
       default:               {res = ERR_INV_SYS_CALL; break;}
     }
     msg.result = res;
-    if (unlikely(__copy_to_user((void __user *) ioctl_param, (void *) &msg, (unsigned long) sizeof(MXP_CMD_T))))
+    if (unlikely(__copy_to_user((void __user *) ioctl_param, (void *) &msg, (unsigned long) size)))
     {
         res = -EFAULT;
         goto error_label;
@@ -570,6 +1312,7 @@ return IRQ_HANDLED;
 static int mxp_read_proc(char *buf, char **start, off_t offset,
                    int count, int *eof, void *data)
 {
+  struct task_struct *p;
   int len = 0;
   int j;
 
@@ -577,11 +1320,25 @@ static int mxp_read_proc(char *buf, char **start, off_t offset,
                  irq_tick, mxp_tick, _clock, _inUse);
 
   for (j=1; j<MXP_TASK_MAX; j++){
+    /* the page is limited, stop before it overflows */
+    if (len > count - 128)
+      break;
     if (mxp_tcb[j].busy){
-      len += sprintf(buf + len, "%2d %5d %3d %-16s %d %08lX %9d\n", j,
+      len += sprintf(buf + len, "%2d %5d %3d %-16s %d %08lX %9d", j,
                  mxp_tcb[j].pid, mxp_tcb[j].priority, mxp_tcb[j].name,
                  mxp_tcb[j].wait4event, mxp_tcb[j].events_posted,
                  mxp_tcb[j].event_cnt);
+      if ((p = tcb_task(j)) != NULL){
+        if ((p->policy == SCHED_FIFO) || (p->policy == SCHED_RR))
+          len += sprintf(buf + len, " %s/%-2d", (p->policy == SCHED_FIFO) ? "fifo" : "rr", p->rt_priority);
+        else
+          len += sprintf(buf + len, " other  ");
+        put_task_struct(p);
+      }
+      if (mxp_subtcb[j].spin_max)
+        len += sprintf(buf + len, " spin %4u/%4u %9lu %9lu", mxp_subtcb[j].spin_win,
+                 mxp_subtcb[j].spin_max, mxp_subtcb[j].spin_hits, mxp_subtcb[j].spin_misses);
+      len += sprintf(buf + len, "\n");
     }
   }
 
@@ -589,13 +1346,57 @@ static int mxp_read_proc(char *buf, char **start, off_t offset,
   return len;
 }
 
+/*********************************************************************************
+* FUNCTION: mxp_affinity_proc
+*
+* DESCRIPTION: forms output for /proc/timxp/affinity: where the timer path and
+*              every task may run and where they ran last
+*********************************************************************************/
+static int mxp_affinity_proc(char *buf, char **start, off_t offset,
+                   int count, int *eof, void *data)
+{
+  struct task_struct *p;
+  int len = 0;
+  int j;
+
+  len += sprintf(buf + len, "timer irq %d last cpu %d\n",
+                 mxp_timer_irq, tmr_last_cpu);
+
+  for (j=1; j<MXP_TASK_MAX; j++){
+    /* the page is limited, stop before it overflows */
+    if (len > count - 128)
+      break;
+    if ((p = tcb_task(j)) == NULL)
+      continue;
+
+    len += sprintf(buf + len, "%2d %5d %-16s %08lX %3d\n", j,
+                   p->pid, mxp_tcb[j].name, tcb_cpuMask(p), task_cpu(p));
+    put_task_struct(p);
+  }
+
+  *eof = 1;
+  return len;
+}
+
 /******************************************************************************/
 /******************************************************************************/
 /* Character device related functions                                         */
 /******************************************************************************/
 /******************************************************************************/
-static void mxp_vma_open(struct vm_area_struct *vma) {/* MOD_INC_USE_COUNT*/ try_module_get (THIS_MODULE);}
-static void mxp_vma_close(struct vm_area_struct *vma){ /* MOD_DEC_USE_COUNT;*/ module_put (THIS_MODULE);}
+/* a mapping of a page of vm_private_data holds a reference to it, so a ring page
+   freed by its task stays until it is unmapped */
+static void mxp_vma_open(struct vm_area_struct *vma)
+{
+    /* MOD_INC_USE_COUNT*/ try_module_get (THIS_MODULE);
+    if (vma->vm_private_data)
+        get_page(virt_to_page(vma->vm_private_data));
+}
+static void mxp_vma_close(struct vm_area_struct *vma)
+{
+    if (vma->vm_private_data)
+        put_page(virt_to_page(vma->vm_private_data));
+    /* MOD_DEC_USE_COUNT;*/ module_put (THIS_MODULE);
+}
 
 /*********************************************************************************
 * FUNCTION: mxp_vma_nopage
@@ -611,6 +1412,14 @@ static int mxp_vma_nopage( struct vm_area_struct *vma,
     pte_t *pte;
     unsigned long lpage = (unsigned long)(mxp_tcb);
 
+    /* the semaphore and mutex page, see mxp_mmap */
+    if (vma->vm_private_data){
+        page = virt_to_page(vma->vm_private_data);
+        get_page(page);
+        vmf->page = page;
+        return 0;
+    }
+
     spin_lock(&(vma->vm_mm->page_table_lock));
     pgd = pgd_offset(vma->vm_mm, lpage);
     pmd = pmd_offset(pgd,      lpage);
@@ -643,6 +1452,31 @@ static int mxp_mmap( struct file * filp, struct vm_area_struct *vma)
         vma->vm_flags |= VM_IO;
     vma->vm_flags |= VM_RESERVED;
 
+    /* MXP_MMAP_SEM_PGOFF selects the semaphore and mutex page, MXP_MMAP_RING_PGOFF
+       and up the command rings of a task, anything else the tcbs */
+    if (vma->vm_pgoff == MXP_MMAP_SEM_PGOFF){
+        if ((vma->vm_end - vma->vm_start) > PAGE_SIZE)
+            return -EINVAL;
+        vma->vm_private_data = mxp_shm;
+    } else if ((vma->vm_pgoff >= MXP_MMAP_RING_PGOFF) &&
+               (vma->vm_pgoff < MXP_MMAP_RING_PGOFF + MXP_TASK_MAX)){
+        MXP_RINGCTL_T *rc = &mring[vma->vm_pgoff - MXP_MMAP_RING_PGOFF];
+
+        if ((vma->vm_end - vma->vm_start) > PAGE_SIZE)
+            return -EINVAL;
+        /* the page reference is taken before the task can free the rings */
+        mutex_lock(&(rc->lock));
+        if (rc->ring == NULL){
+            mutex_unlock(&(rc->lock));
+            return -EINVAL;
+        }
+        vma->vm_private_data = rc->ring;
+        vma->vm_ops = &mxp_vm_ops;
+        mxp_vma_open(vma);
+        mutex_unlock(&(rc->lock));
+        return 0;
+    }
+
     vma->vm_ops = &mxp_vm_ops;
     mxp_vma_open(vma);
 
@@ -709,6 +1543,12 @@ int __init init_module(void)
 {
     int j, error_num;
 
+    /* the original ioctl codes fill the start of MXP_CMD_T */
+    BUILD_BUG_ON(offsetof(MXP_CMD_T, cp.q.name) != offsetof(MXP_CMD_V1_T, cp.q.name));
+    BUILD_BUG_ON(offsetof(MXP_CMD_T, cp.task.tid) != offsetof(MXP_CMD_V1_T, cp.task.tid));
+    BUILD_BUG_ON(offsetof(MXP_CMD_T, cp.ev.timeout) != offsetof(MXP_CMD_V1_T, cp.ev.timeout));
+    BUILD_BUG_ON(offsetof(MXP_CMD_T, cp.tmr.reload) != offsetof(MXP_CMD_V1_T, cp.tmr.reload));
+
     if(mmxp_timer_init())
     {
         return 1;
@@ -720,11 +1560,15 @@ int __init init_module(void)
         return 1;
     }
     memset(mxp_tcb, 0, sizeof(MXP_TCB_T) * MXP_TASK_MAX);
+    nidx_Init(&tcb_names, tcb_names_next, mxp_tcb, sizeof(MXP_TCB_T),
+              offsetof(MXP_TCB_T, name), MXP_TASK_MAX);
+    idalloc_Init(&tcb_ids, tcb_ids_map, tcb_ids_stack, MXP_TASK_MAX, 1);
 
     memset(mxp_subtcb, 0, sizeof(mxp_subtcb));
     for (j = 1; j < MXP_TASK_MAX; j++)
     {
         init_waitqueue_head(&(mxp_subtcb[j].gate_lock));
+        spin_lock_init(&(mxp_subtcb[j].lock));
     }
 
     error_num = misc_register(&mxpcore_miscdev);
@@ -740,6 +1584,13 @@ int __init init_module(void)
 
     create_proc_read_entry("core", 0, mxp_proc_dir, mxp_read_proc, NULL);
     create_proc_read_entry("queue", 0, mxp_proc_dir, mxp_queue_proc, NULL);
+    create_proc_read_entry("squeue", 0, mxp_proc_dir, mxp_squeue_proc, NULL);
+    create_proc_read_entry("fanout", 0, mxp_proc_dir, mxp_fanout_proc, NULL);
+    create_proc_read_entry("affinity", 0, mxp_proc_dir, mxp_affinity_proc, NULL);
+    create_proc_read_entry("sem", 0, mxp_proc_dir, mxp_sem_proc, NULL);
+    create_proc_read_entry("mutex", 0, mxp_proc_dir, mxp_mutex_proc, NULL);
+    create_proc_read_entry("lwt", 0, mxp_proc_dir, mxp_lwt_proc, NULL);
+    create_proc_read_entry("ring", 0, mxp_proc_dir, mxp_ring_proc, NULL);
 
     printk("MXP module loaded\n");
     return 0;
@@ -754,6 +1605,7 @@ void __exit cleanup_module(void)
 {
 
     int err;
+    int j;
 
     if(mmxp_timer_cleanup())
     {
@@ -761,8 +1613,20 @@ void __exit cleanup_module(void)
     }
     tasklet_kill( &tmrobj_tasklet );
 
+    /* drop the thread references of the tasks still allocated */
+    for (j = 1; j < MXP_TASK_MAX; j++)
+        if (mxp_subtcb[j].task)
+            put_task_struct(mxp_subtcb[j].task);
+
     remove_proc_entry("core", mxp_proc_dir);
     remove_proc_entry("queue", mxp_proc_dir);
+    remove_proc_entry("squeue", mxp_proc_dir);
+    remove_proc_entry("fanout", mxp_proc_dir);
+    remove_proc_entry("affinity", mxp_proc_dir);
+    remove_proc_entry("sem", mxp_proc_dir);
+    remove_proc_entry("mutex", mxp_proc_dir);
+    remove_proc_entry("lwt", mxp_proc_dir);
+    remove_proc_entry("ring", mxp_proc_dir);
     remove_proc_entry(MXP_PROC_DIR_NAME,NULL);
 
     err = misc_deregister(&mxpcore_miscdev);
@@ -771,6 +1635,16 @@ void __exit cleanup_module(void)
         printk(KERN_ERR "mxpcore: cannot de-register miscdev err=%d\n", err);
     }
 
+    /* nobody has it mapped, a mapping holds a module reference */
+    free_page((unsigned long)mxp_shm);
+    for (j = 1; j < MXP_TASK_MAX; j++)
+        ring_free(j);
+
+    /* the device is gone, free the stores of the objects still created */
+    mxp_q_delete_all();
+    mxp_sq_delete_all();
+    mxp_fan_delete_all();
+
     printk("MXP module unloaded\n");
 }
 
@@ -844,11 +1718,12 @@ void tmrobj_clock(unsigned long dummy) {
   unsigned long delta_tick;
   unsigned long irq_st;
 
-  local_irq_save(irq_st);
+  tmr_last_cpu = smp_processor_id();
+
+  spin_lock_irqsave(&tmr_base_lock, irq_st);
   delta_tick = irq_tick - mxp_tick;
   if (delta_tick == 0){
-    local_irq_restore(irq_st);
-    up(&tmr_lock);
+    spin_unlock_irqrestore(&tmr_base_lock, irq_st);
     return;
   }
 
@@ -867,9 +1742,9 @@ void tmrobj_clock(unsigned long dummy) {
     if (0 < _inUse)  DownTree((*First));
 
     if(Act->actionCB){
-      local_irq_restore(irq_st);
+      spin_unlock_irqrestore(&tmr_base_lock, irq_st);
       Act->actionCB( Act );
-      local_irq_save(irq_st);
+      spin_lock_irqsave(&tmr_base_lock, irq_st);
     }
 
   }
@@ -882,7 +1757,7 @@ void tmrobj_clock(unsigned long dummy) {
     _clock = 0;  /* Vitaly: TODO: may be "_clock -= MAX_CLOCK" is more correct */
   }
 
-  local_irq_restore(irq_st);
+  spin_unlock_irqrestore(&tmr_base_lock, irq_st);
 }
 
 /*********************************************************************************
@@ -51,6 +51,7 @@ typedef struct PART_HDR_tag {
 
 
 typedef struct SEGMENT_DESC_tag {
+  spinlock_t    lock;   /* guards the partitions of the segment */
   unsigned long Seg_ID;
   char          name[MAX_NAME_LEN];
   unsigned char *segPtr;
@@ -68,12 +69,42 @@ typedef struct SEGMENT_DESC_tag {
 
 static SEGMENT_DESC_T seg_descs[MAX_SEGMENTS];
 
-/* variables used to lock mxp. It should disable ISR when locked ? */
-/* since spin_lock_irqsave/restore was changed to local_irq_save/restore */
-/*static spinlock_t    mxp_lock = SPIN_LOCK_UNLOCKED; */
+#include "mmxp_name.c"
+#include "mmxp_id.c"
+
+/* segment name index */
+static MXP_NAME_IDX_T seg_names;
+static short          seg_names_next[MAX_SEGMENTS];
+
+/* segment ID allocator */
+static MXP_ID_ALLOC_T seg_ids;
+static DECLARE_BITMAP(seg_ids_map, MAX_SEGMENTS);
+static short          seg_ids_stack[MAX_SEGMENTS];
+
+/* seg_table_lock guards the segment names and IDs, the partition headers
+   and free lists of a segment are guarded by the lock of that segment.
+   Segments are never deleted, seg_table_lock is never taken with a segment lock. */
+static DEFINE_SPINLOCK(seg_table_lock);
 
 #define SEG_INVALID(X) (((X) >= MAX_SEGMENTS)||(seg_descs[(X)].Seg_ID == FREE_SEG))
 
+#define SEG_LOCK(X, fl)    spin_lock_irqsave(&(seg_descs[(X)].lock), fl)
+#define SEG_UNLOCK(X, fl)  spin_unlock_irqrestore(&(seg_descs[(X)].lock), fl)
+
+/* lock segment segId, returns 0 (and leaves it unlocked) if there is none */
+static inline int seg_lock(unsigned long segId, unsigned long *fl)
+{
+  if (segId >= MAX_SEGMENTS)
+    return 0;
+
+  SEG_LOCK(segId, *fl);
+  if (seg_descs[segId].Seg_ID != FREE_SEG)
+    return 1;
+
+  SEG_UNLOCK(segId, *fl);
+  return 0;
+}
+
 /********************************************************************************/
 /* Local functions                                                              */
 /*********************************************************************************
@@ -85,11 +116,10 @@ static unsigned int look4FreeSeg(void)
 {
   int j;
 
-  for (j=0; j<MAX_SEGMENTS; j++)
-    if (seg_descs[j].Seg_ID == FREE_SEG)
-      return j;
+  if ((j = idalloc_Get(&seg_ids)) < 0)
+    return FREE_SEG;
 
-  return FREE_SEG;
+  return j;
 }
 
 /*********************************************************************************
@@ -101,11 +131,10 @@ static unsigned int segByName(char *seg_name)
 {
   int j;
 
-  for (j=0; j<MAX_SEGMENTS; j++)
-    if ((seg_descs[j].Seg_ID != FREE_SEG)&&(!(strcmp(seg_descs[j].name, seg_name))))
-      return j;
+  if ((j = nidx_Find(&seg_names, seg_name)) < 0)
+    return FREE_SEG; /* name not found */
 
-  return FREE_SEG; /* name not found */
+  return j;
 }
 
 /********************************************************************************/
@@ -121,8 +150,14 @@ static void mxp_segInit(void)
 
   memset(seg_descs, 0, sizeof(seg_descs));
 
-  for (j = 0; j < MAX_SEGMENTS; j++)
+  for (j = 0; j < MAX_SEGMENTS; j++){
+    spin_lock_init(&(seg_descs[j].lock));
     seg_descs[j].Seg_ID  = FREE_SEG;
+  }
+
+  nidx_Init(&seg_names, seg_names_next, seg_descs, sizeof(SEGMENT_DESC_T),
+            offsetof(SEGMENT_DESC_T, name), MAX_SEGMENTS);
+  idalloc_Init(&seg_ids, seg_ids_map, seg_ids_stack, MAX_SEGMENTS, 0);
 }
 
 /*********************************************************************************
@@ -135,20 +170,22 @@ static int mxp_segCreate(MXP_MEM_CMD_T*  msg)
   unsigned long irq_st;
   unsigned int free_seg;
 
-  local_irq_save(irq_st);
-
-  if ((free_seg = look4FreeSeg()) == FREE_SEG ){
-    local_irq_restore(irq_st);
-    return ERR_NOSEG;
-  }
+  spin_lock_irqsave(&seg_table_lock, irq_st);
 
   if (segByName(msg->name) != FREE_SEG){
-    local_irq_restore(irq_st);
+    spin_unlock_irqrestore(&seg_table_lock, irq_st);
     return ERR_ASGN;
   }
 
+  if ((free_seg = look4FreeSeg()) == FREE_SEG ){
+    spin_unlock_irqrestore(&seg_table_lock, irq_st);
+    return ERR_NOSEG;
+  }
+
+  spin_lock(&(seg_descs[free_seg].lock));
   seg_descs[free_seg].Seg_ID  = free_seg;
   strcpy(seg_descs[free_seg].name, msg->name);
+  nidx_Insert(&seg_names, free_seg);
   seg_descs[free_seg].segPtr  = (unsigned char*)msg->ptr;
   seg_descs[free_seg].SegSize = msg->length;
   seg_descs[free_seg].PartCnt = 0;
@@ -156,7 +193,8 @@ static int mxp_segCreate(MXP_MEM_CMD_T*  msg)
 
   msg->segId = free_seg;
 
-  local_irq_restore(irq_st);
+  spin_unlock(&(seg_descs[free_seg].lock));
+  spin_unlock_irqrestore(&seg_table_lock, irq_st);
   return ERR_NOERR;
 }
 
@@ -170,13 +208,13 @@ static int mxp_segIdentify(MXP_MEM_CMD_T*  msg)
   unsigned long irq_st;
   int          ret = ERR_NOERR;
 
-  local_irq_save(irq_st);
+  spin_lock_irqsave(&seg_table_lock, irq_st);
 
   if ((msg->segId = segByName(msg->name)) == FREE_SEG){
     ret = ERR_INVNAME;
   }
 
-  local_irq_restore(irq_st);
+  spin_unlock_irqrestore(&seg_table_lock, irq_st);
 
   return ret;
 }
@@ -190,16 +228,12 @@ int mxp_segGetName(MXP_MEM_CMD_T*  msg)
 {
   unsigned long irq_st;
 
-  local_irq_save(irq_st);
-
-  if (SEG_INVALID(msg->segId)){
-    local_irq_restore(irq_st);
+  if (!seg_lock(msg->segId, &irq_st))
     return ERR_SEGINV;
-  }
 
   strcpy(msg->name, seg_descs[msg->segId].name);
 
-  local_irq_restore(irq_st);
+  SEG_UNLOCK(msg->segId, irq_st);
   return ERR_NOERR;
 }
 
@@ -221,18 +255,15 @@ static int mxp_pCreate(MXP_MEM_CMD_T*  msg)
   int j;
   unsigned long irq_st;
 
-  local_irq_save(irq_st);
   /* Do we have this segment? */
-  if (SEG_INVALID(msg->segId)){
-    local_irq_restore(irq_st);
+  if (!seg_lock(msg->segId, &irq_st))
     return ERR_SEGINV;
-  }
 
   /* Do we have enough room? */
   reqSize  = sizeof(PART_HDR_T) + msg->length * msg->blocks;
   freeSize = seg_descs[msg->segId].Top - (sizeof(PART_HDR_T) * seg_descs[msg->segId].PartCnt);
   if (freeSize < reqSize){
-    local_irq_restore(irq_st);
+    SEG_UNLOCK(msg->segId, irq_st);
     return ERR_NOMEM;
   }
 
@@ -257,7 +288,7 @@ static int mxp_pCreate(MXP_MEM_CMD_T*  msg)
   }
 
   msg->partId = partHdr[partId].Part_ID;
-  local_irq_restore(irq_st);
+  SEG_UNLOCK(msg->segId, irq_st);
   return ERR_NOERR;
 }
 
@@ -272,13 +303,9 @@ static int mxp_pIdentify(MXP_MEM_CMD_T*  msg)
   unsigned int  j;
   unsigned long irq_st;
 
-  local_irq_save(irq_st);
-
   /* Do we have this segment? */
-  if (SEG_INVALID(msg->segId)){
-    local_irq_restore(irq_st);
+  if (!seg_lock(msg->segId, &irq_st))
     return ERR_SEGINV;
-  }
 
   partHdr = (PART_HDR_T*) seg_descs[msg->segId].segPtr;
 
@@ -286,12 +313,12 @@ static int mxp_pIdentify(MXP_MEM_CMD_T*  msg)
     for (j=0; j<seg_descs[msg->segId].PartCnt; j++)
       if (strcmp(partHdr[j].name, msg->name) == 0){
         msg->partId = partHdr[j].Part_ID;
-        local_irq_restore(irq_st);
+        SEG_UNLOCK(msg->segId, irq_st);
         return ERR_NOERR;
       }
   } /* if (seg... */
 
-  local_irq_restore(irq_st);
+  SEG_UNLOCK(msg->segId, irq_st);
   return ERR_INVNAME;
 }
 
@@ -307,15 +334,12 @@ static int mxp_pInquiry(MXP_MEM_CMD_T*  msg)
   PART_HDR_T    *partHdr;
   unsigned long irq_st;
 
-  local_irq_save(irq_st);
   /* Do we have this segment? */
-  if (SEG_INVALID(segID)){
-    local_irq_restore(irq_st);
+  if (!seg_lock(segID, &irq_st))
     return ERR_PARTINV;
-  }
 
   if (parID >= seg_descs[segID].PartCnt){
-    local_irq_restore(irq_st);
+    SEG_UNLOCK(segID, irq_st);
     return ERR_PARTINV;
   }
 
@@ -323,7 +347,7 @@ static int mxp_pInquiry(MXP_MEM_CMD_T*  msg)
 
   msg->blocks = partHdr[parID].FreeBlocks;
 
-  local_irq_restore(irq_st);
+  SEG_UNLOCK(segID, irq_st);
   return ERR_NOERR;
 }
 
@@ -340,22 +364,19 @@ static int mxp_pBalloc(MXP_MEM_CMD_T*  msg)
   BLOCK_T       *blkTmpPtr;
   unsigned long irq_st;
 
-  local_irq_save(irq_st);
   /* Do we have this segment? */
-  if (SEG_INVALID(segID)){
-    local_irq_restore(irq_st);
+  if (!seg_lock(segID, &irq_st))
     return ERR_PARTINV;
-  }
 
   if (parID >= seg_descs[segID].PartCnt){
-    local_irq_restore(irq_st);
+    SEG_UNLOCK(segID, irq_st);
     return ERR_PARTINV;
   }
 
   partHdr = (PART_HDR_T*) seg_descs[segID].segPtr;
 
   if (partHdr[parID].FreeBlocks == 0){
-    local_irq_restore(irq_st);
+    SEG_UNLOCK(segID, irq_st);
     return ERR_NOMEM;
   }
 
@@ -365,7 +386,7 @@ static int mxp_pBalloc(MXP_MEM_CMD_T*  msg)
   blkTmpPtr->next     = (BLOCK_T*)BLOCK_BUSY;    /* mark block as busy*/
   partHdr[parID].FreeBlocks--;                   /* adjust counter*/
 
-  local_irq_restore(irq_st);
+  SEG_UNLOCK(segID, irq_st);
   return ERR_NOERR;
 }
 
@@ -382,15 +403,12 @@ static int mxp_pBfree(MXP_MEM_CMD_T*  msg)
   BLOCK_T       *blkTmpPtr;
   unsigned long irq_st;
 
-  local_irq_save(irq_st);
   /* Do we have this segment? */
-  if (SEG_INVALID(segID)){
-    local_irq_restore(irq_st);
+  if (!seg_lock(segID, &irq_st))
     return ERR_PARTINV;
-  }
 
   if (parID >= seg_descs[segID].PartCnt){
-    local_irq_restore(irq_st);
+    SEG_UNLOCK(segID, irq_st);
     return ERR_PARTINV;
   }
 
@@ -398,7 +416,7 @@ static int mxp_pBfree(MXP_MEM_CMD_T*  msg)
 
   blkTmpPtr = (BLOCK_T*)((unsigned char*)(msg->ptr) - sizeof(void*));
   if (blkTmpPtr->next != ((BLOCK_T*)BLOCK_BUSY)){
-    local_irq_restore(irq_st);
+    SEG_UNLOCK(segID, irq_st);
     return ERR_FREE;
   }
 
@@ -406,7 +424,7 @@ static int mxp_pBfree(MXP_MEM_CMD_T*  msg)
   partHdr[parID].FreeList = blkTmpPtr;
   partHdr[parID].FreeBlocks++;
 
-  local_irq_restore(irq_st);
+  SEG_UNLOCK(segID, irq_st);
   return ERR_NOERR;
 }
 
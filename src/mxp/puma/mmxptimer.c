@@ -82,12 +82,23 @@ int mmxp_timer_init(void)
     tmrobj_init();
     mxl_tmr_init();
     q_Init();
+    sq_Init();
+    fan_Init();
+    if (sem_Init())
+    {
+        printk("Cannot allocate MXP semaphore page\n");
+        return 1;
+    }
+    mtx_Init();
+    lwt_Init();
+    ring_Init();
 
     if (request_irq(LNXINTNUM(AVALANCHE_TIMER_1_INT), mxp_timer_irq_handle, SA_INTERRUPT, "mxp_timer", NULL))
     {
         printk("Cannot register mxt_timer interrupt\n");
         return 1;
     }
+    mxp_timer_pin(LNXINTNUM(AVALANCHE_TIMER_1_INT));
 
     return 0;
 }